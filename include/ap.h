@@ -10,7 +10,8 @@
 #include "greybus_messages.h"
 #include "greybus_interfaces.h"
 
-#define AP_MAX_NODES CONFIG_BEAGLEPLAY_GREYBUS_MAX_NODES
+#define AP_MAX_NODES  CONFIG_BEAGLEPLAY_GREYBUS_MAX_NODES
+#define AP_MAX_CPORTS CONFIG_BEAGLEPLAY_GREYBUS_MAX_CPORTS
 
 #define AP_INF_ID       1
 #define AP_SVC_CPORT_ID 0
@@ -43,6 +44,16 @@ static inline int ap_rx_submit(struct gb_message *msg, uint16_t cport_id)
 	return connection_send(AP_INF_ID, cport_id, msg);
 }
 
+/*
+ * Queue a message for the AP. Blocks while the transmit queue is full, for at most
+ * CONFIG_BEAGLEPLAY_GREYBUS_AP_TX_TIMEOUT_MS. Called from an ISR, the HDLC RX workqueue or a
+ * node RX thread, the message is dropped at once instead.
+ *
+ * @param greybus message. The ownership is transferred.
+ * @param cport_id
+ *
+ * @return 0 if successful, negative in case of error
+ */
 int ap_send(struct gb_message *msg, uint16_t cport);
 
 #endif
@@ -7,8 +7,131 @@
 #define _APBRIDGE_H_
 
 #include <stdint.h>
+#include "greybus_interfaces.h"
 #include "greybus_messages.h"
 
+/* Bridge specific APBridge requests, not part of the upstream protocol */
+#define APBRIDGE_REQUEST_LATENCY_TAG_GET    0x80
+#define APBRIDGE_REQUEST_STATS_GET          0x81
+#define APBRIDGE_REQUEST_STATS_RESET        0x82
+#define APBRIDGE_REQUEST_NODE_TX_STATS_GET  0x83
+#define APBRIDGE_REQUEST_NODE_HEARTBEAT_GET 0x84
+#define APBRIDGE_REQUEST_NODE_RX_STATS_GET  0x85
+#define APBRIDGE_REQUEST_PEER_STATS_GET     0x86
+
+#define CONNECTION_LATENCY_BUCKETS 20
+
+/*
+ * Points at which a latency tagged message is timestamped.
+ */
+enum connection_latency_stage {
+	CONNECTION_LATENCY_UART_RX,
+	CONNECTION_LATENCY_NODE_TX,
+	CONNECTION_LATENCY_NODE_RX,
+	CONNECTION_LATENCY_UART_TX,
+};
+
+/*
+ * Hops reported by latency tagging. Each hop has a log2 histogram of CONNECTION_LATENCY_BUCKETS
+ * buckets, where bucket i counts latencies in [2^i, 2^(i + 1)) us.
+ */
+enum connection_latency_hop {
+	/* UART RX to node TCP TX */
+	CONNECTION_LATENCY_HOP_INGRESS,
+	/* Node TCP TX to node response */
+	CONNECTION_LATENCY_HOP_NODE,
+	/* Node response to UART TX */
+	CONNECTION_LATENCY_HOP_EGRESS,
+	/* UART RX to UART TX */
+	CONNECTION_LATENCY_HOP_TOTAL,
+	CONNECTION_LATENCY_HOPS,
+};
+
+/*
+ * APBRIDGE_REQUEST_LATENCY_TAG_GET request and response
+ */
+struct apbridge_latency_tag_get_request {
+	__u8 hop;
+} __packed;
+
+struct apbridge_latency_tag_get_response {
+	__le32 buckets[CONNECTION_LATENCY_BUCKETS];
+} __packed;
+
+/*
+ * APBRIDGE_REQUEST_STATS_GET response. TX is from the AP towards the node, RX the other way.
+ * Latency is from request to response in the same log2 buckets as latency tagging.
+ */
+struct apbridge_stats_get_response {
+	__le32 tx_messages;
+	__le32 tx_bytes;
+	__le32 rx_messages;
+	__le32 rx_bytes;
+	__le32 drops;
+	__le32 send_failures;
+	__le32 latency_buckets[CONNECTION_LATENCY_BUCKETS];
+	__le16 node_cport;
+	__u8 node_id;
+} __packed;
+
+/*
+ * APBRIDGE_REQUEST_PEER_STATS_GET request, for a connection between two nodes given by one of its
+ * ends. The response is an apbridge_stats_get_response, where TX is from that end towards the
+ * other, whose node id and cport are reported. The Cport of the request is ignored.
+ */
+struct apbridge_peer_stats_get_request {
+	__le16 cport;
+	__u8 intf_id;
+} __packed;
+
+/*
+ * APBRIDGE_REQUEST_NODE_TX_STATS_GET request and response. The Cport of the request is ignored.
+ */
+struct apbridge_node_tx_stats_get_request {
+	__u8 intf_id;
+} __packed;
+
+struct apbridge_node_tx_stats_get_response {
+	__le32 sent;
+	__le32 retries;
+	__le32 drops;
+	__le32 oldest_age_ms;
+	__le32 max_age_ms;
+	__le16 depth;
+	__le16 max_depth;
+	__le32 writes;
+} __packed;
+
+/*
+ * APBRIDGE_REQUEST_NODE_HEARTBEAT_GET request and response. The Cport of the request is ignored.
+ */
+struct apbridge_node_heartbeat_get_request {
+	__u8 intf_id;
+} __packed;
+
+struct apbridge_node_heartbeat_get_response {
+	__le32 sent;
+	__le32 lost;
+	__le32 rtt_last_us;
+	__le32 rtt_avg_us;
+	__le32 rtt_max_us;
+} __packed;
+
+/*
+ * APBRIDGE_REQUEST_NODE_RX_STATS_GET request and response. The Cport of the request is ignored.
+ */
+struct apbridge_node_rx_stats_get_request {
+	__u8 shard;
+} __packed;
+
+struct apbridge_node_rx_stats_get_response {
+	__le32 messages;
+	__le32 bytes;
+	__le32 wakeups;
+	__le16 sockets;
+	__u8 shards;
+} __packed;
+
 void apbridge_init(void);
 
 void apbridge_deinit(void);
@@ -19,8 +142,71 @@ int connection_create(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
 int connection_destroy(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
 		       uint16_t intf2_cport);
 
+/*
+ * Route a message to the other end of a connection.
+ *
+ * @param interface the message is sent from
+ * @param cport of the interface
+ * @param greybus message. The ownership is transferred, even in case of error.
+ *
+ * @return 0 if successful, negative in case of error
+ */
 int connection_send(uint8_t intf_id, uint16_t intf_cport, struct gb_message *msg);
 
+/*
+ * Drop every route through an interface that is being removed, so that messages can no longer
+ * reach it. The AP still destroys the connections afterwards.
+ *
+ * @param interface
+ */
+void connection_forget_interface(struct gb_interface *intf);
+
+/*
+ * Check if the AP marked a cport as high priority with GB_APB_CPORT_FLAG_HIGH_PRIO.
+ *
+ * @param AP cport
+ *
+ * @return true if high priority
+ */
+bool connection_is_high_prio(uint16_t ap_cport);
+
+/*
+ * Check if the connection of a node cport is high priority.
+ *
+ * @param node interface id
+ * @param cport of the node
+ *
+ * @return true if high priority
+ */
+bool connection_node_is_high_prio(uint8_t node_id, uint16_t node_cport);
+
+/*
+ * Timestamp a message on a latency tagged connection. Does nothing if latency tagging is not
+ * enabled for the connection.
+ *
+ * @param interface the message is sent from or delivered to
+ * @param cport of the interface
+ * @param greybus message
+ * @param stage reached by the message
+ */
+void connection_latency_tag(uint8_t intf_id, uint16_t intf_cport, const struct gb_message *msg,
+			    enum connection_latency_stage stage);
+
+/*
+ * Handle an APBridge request received over the control channel.
+ *
+ * @param APBridge request type
+ * @param AP cport the request applies to
+ * @param request payload
+ * @param request payload length
+ * @param response buffer
+ * @param response buffer length
+ *
+ * @return response length if successful, negative in case of error
+ */
+int apbridge_control_request(uint8_t request, uint16_t cport, const void *data, size_t data_len,
+			     void *resp, size_t resp_len);
+
 /*
  * Send a message to the node
  *
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+/*
+ * Deferred reclamation for objects that readers use without holding a lock, such as pointers
+ * copied out of a seqlock read section. Readers count themselves in the current epoch for as long
+ * as they use such pointers. An object is freed once it has been unpublished and, after that, the
+ * epoch has been flipped twice with the readers of the old epoch drained after each flip. Any
+ * reader that could have seen the object has then ended.
+ *
+ * Flipping keeps new readers off the counter being drained, so readers never wait and the writer
+ * is not starved by overlapping readers. Read sections nest.
+ *
+ * @param current: epoch new readers count themselves in, only the low bit is used
+ * @param readers: readers in each epoch
+ */
+struct epoch {
+	atomic_t current;
+	atomic_t readers[2];
+};
+
+/*
+ * Start a read section.
+ *
+ * @param ep
+ *
+ * @return key to pass to epoch_read_unlock()
+ */
+static inline int epoch_read_lock(struct epoch *ep)
+{
+	int idx = atomic_get(&ep->current) & 1;
+
+	/* Pointers must only be loaded once the reader is counted */
+	atomic_inc(&ep->readers[idx]);
+
+	return idx;
+}
+
+/*
+ * End a read section.
+ *
+ * @param ep
+ * @param key: returned by epoch_read_lock()
+ */
+static inline void epoch_read_unlock(struct epoch *ep, int key)
+{
+	atomic_dec(&ep->readers[key]);
+}
+
+/*
+ * Move new readers to the other epoch. Flips must be serialized by the caller.
+ *
+ * @param ep
+ *
+ * @return epoch left, to pass to epoch_drained()
+ */
+static inline int epoch_flip(struct epoch *ep)
+{
+	return atomic_inc(&ep->current) & 1;
+}
+
+/*
+ * Check if all readers of an epoch have ended.
+ *
+ * @param ep
+ * @param idx: epoch returned by epoch_flip()
+ *
+ * @return true if no reader is left
+ */
+static inline bool epoch_drained(struct epoch *ep, int idx)
+{
+	return !atomic_get(&ep->readers[idx]);
+}
+
+#endif
@@ -6,6 +6,7 @@
 #ifndef _OPERATIONS_H_
 #define _OPERATIONS_H_
 
+#include <zephyr/sys/atomic.h>
 #include <zephyr/sys/dlist.h>
 #include <zephyr/types.h>
 #include "greybus_messages.h"
@@ -48,6 +49,7 @@ typedef void (*gb_controller_destroy_connection_t)(struct gb_interface *, uint16
  * @param write: a non-blocking write function. The ownership of message is
  * transferred.
  * @param ctrl_data: private controller data
+ * @param high_prio_cports: number of connected cports flagged high priority by the AP
  */
 struct gb_interface {
 	uint8_t id;
@@ -55,6 +57,7 @@ struct gb_interface {
 	gb_controller_create_connection_t create_connection;
 	gb_controller_destroy_connection_t destroy_connection;
 	void *ctrl_data;
+	atomic_t high_prio_cports;
 };
 
 /*
@@ -81,7 +84,8 @@ struct gb_interface *gb_interface_alloc(gb_controller_write_callback_t write_cb,
 void gb_interface_dealloc(struct gb_interface *intf);
 
 /*
- * Get interface associated with interface id.
+ * Get interface associated with interface id. Node interfaces must be looked up inside a node
+ * read section, see node_read_lock().
  *
  * @param interface id
  *
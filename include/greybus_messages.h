@@ -68,7 +68,7 @@ static inline bool gb_hdr_is_response(const struct gb_operation_msg_hdr *hdr)
  */
 static inline bool gb_hdr_is_success(const struct gb_operation_msg_hdr *hdr)
 {
-	return hdr->result == 0x00;
+	return hdr->result == GB_OP_SUCCESS;
 }
 
 /*
@@ -96,11 +96,11 @@ static inline bool gb_message_is_success(const struct gb_message *msg)
 }
 
 /*
- * Allocate Greybus message
+ * Allocate Greybus message. The header is stored in wire (little endian) byte order.
  *
  * @param Payload len
  * @param Response Type
- * @param Operation ID of Request
+ * @param Operation ID of Request, in CPU byte order
  * @param Status
  *
  * @return greybus message allocated on heap. Null in case of error
@@ -116,17 +116,26 @@ struct gb_message *gb_message_alloc(size_t payload_len, uint8_t message_type, ui
 void gb_message_dealloc(struct gb_message *msg);
 
 /*
- * Allocate a greybus request message
+ * Duplicate a greybus message.
+ *
+ * @param message to copy
+ *
+ * @return greybus message allocated on heap. Null in case of error
+ */
+struct gb_message *gb_message_copy(const struct gb_message *msg);
+
+/*
+ * Allocate a greybus request message. The operation id is left as 0 (unidirectional) and is
+ * assigned by gb_operation_send_request() for requests expecting a response.
  *
  * @param Payload
  * @param Payload len
  * @param Request Type
- * @param Is one shot
  *
  * @return greybus message allocated on heap. Null in case of error
  */
 struct gb_message *gb_message_request_alloc(const void *payload, size_t payload_len,
-					    uint8_t request_type, bool is_oneshot);
+					    uint8_t request_type);
 
 /*
  * Allocate a greybus response message
@@ -134,7 +143,7 @@ struct gb_message *gb_message_request_alloc(const void *payload, size_t payload_
  * @param Payload
  * @param Payload len
  * @param Request Type
- * @param Operation ID of Request
+ * @param Operation ID of Request, in CPU byte order
  * @param Status
  *
  * @return greybus message allocated on heap. Null in case of error
@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _GREYBUS_OPERATIONS_H_
+#define _GREYBUS_OPERATIONS_H_
+
+#include <zephyr/types.h>
+#include "greybus_messages.h"
+
+#define GB_OPERATION_TIMEOUT_MS CONFIG_BEAGLEPLAY_GREYBUS_OPERATION_TIMEOUT_MS
+#define GB_OPERATION_RETRIES    CONFIG_BEAGLEPLAY_GREYBUS_OPERATION_RETRIES
+
+struct gb_operation;
+
+/*
+ * Callback invoked once a tracked operation completes. Runs in the context that delivered the
+ * response, or on the operation workqueue for timeouts.
+ *
+ * @param operation
+ * @param greybus response. NULL if the operation did not receive a response. Ownership is not
+ * transferred.
+ * @param 0 if a response was received, -ETIMEDOUT if all retries timed out, -ECANCELED if the
+ * operation was cancelled.
+ */
+typedef void (*gb_operation_callback_t)(const struct gb_operation *, const struct gb_message *,
+					int);
+
+/*
+ * Transmit a request of a tracked operation.
+ *
+ * @param interface
+ * @param cport of the interface
+ * @param greybus request. The ownership is transferred, even in case of error.
+ *
+ * @return 0 if successful, negative in case of error
+ */
+typedef int (*gb_operation_send_t)(uint8_t, uint16_t, struct gb_message *);
+
+/*
+ * An outstanding greybus operation originated by the bridge, or forwarded by it, see
+ * gb_operation_observe_request().
+ *
+ * @param request: copy of the request kept for retransmission
+ * @param send: transmits the request and its retransmissions. NULL for forwarded requests.
+ * @param callback: completion callback
+ * @param user_data: opaque data for the callback
+ * @param start: cycle count when the request was first sent
+ * @param deadline: uptime (ms) at which the current attempt times out
+ * @param latency_us: time between the first send and the response
+ * @param timeout_ms: timeout of a single attempt
+ * @param operation_id: operation id of the request
+ * @param cport: cport of the originating interface
+ * @param intf_id: originating interface
+ * @param type: request type
+ * @param retries: retransmissions left
+ */
+struct gb_operation {
+	struct gb_message *request;
+	gb_operation_send_t send;
+	gb_operation_callback_t callback;
+	void *user_data;
+	uint32_t start;
+	int64_t deadline;
+	uint32_t latency_us;
+	uint32_t timeout_ms;
+	uint16_t operation_id;
+	uint16_t cport;
+	uint8_t intf_id;
+	uint8_t type;
+	uint8_t retries;
+};
+
+/*
+ * Send a request and track it until a response arrives or it times out.
+ *
+ * @param originating interface
+ * @param cport of originating interface
+ * @param greybus request. The ownership is transferred.
+ * @param timeout of a single attempt in ms
+ * @param number of retransmissions after a timeout
+ * @param completion callback
+ * @param user data passed back to the callback
+ *
+ * @return operation id if successful, negative in case of error
+ */
+int gb_operation_send_request(uint8_t intf_id, uint16_t cport, struct gb_message *msg,
+			      uint32_t timeout_ms, uint8_t retries,
+			      gb_operation_callback_t callback, void *user_data);
+
+/*
+ * Send a request with a transmit function other than connection_send() and track it as
+ * gb_operation_send_request() does. Used to send requests straight to an interface, whose
+ * responses must then be passed to gb_operation_handle_response() with the interface and cport
+ * the request was sent to.
+ *
+ * @param transmit function
+ * @param interface
+ * @param cport of the interface
+ * @param greybus request. The ownership is transferred.
+ * @param timeout of a single attempt in ms
+ * @param number of retransmissions after a timeout
+ * @param completion callback
+ * @param user data passed back to the callback
+ *
+ * @return operation id if successful, negative in case of error
+ */
+int gb_operation_send_request_via(gb_operation_send_t send, uint8_t intf_id, uint16_t cport,
+				  struct gb_message *msg, uint32_t timeout_ms, uint8_t retries,
+				  gb_operation_callback_t callback, void *user_data);
+
+/*
+ * Match a response against the outstanding operations of the bridge and complete the operation
+ * it belongs to.
+ *
+ * @param interface the response was delivered to
+ * @param cport the response was delivered to
+ * @param greybus response. Ownership is not transferred.
+ *
+ * @return true if the response matched an outstanding operation
+ */
+bool gb_operation_handle_response(uint8_t intf_id, uint16_t cport, const struct gb_message *msg);
+
+/*
+ * Track a request that the bridge forwards for another originator, to measure the time until its
+ * response is forwarded back. Nothing is retransmitted. The response must be passed to
+ * gb_operation_observe_response(), gb_operation_handle_response() ignores such operations. Only
+ * a few forwarded requests are tracked at a time, so that the bridge's own requests always find
+ * room.
+ *
+ * @param interface the response is expected from
+ * @param cport the response is expected from
+ * @param header of the request
+ * @param timeout in ms
+ * @param completion callback. Runs with -ETIMEDOUT if no response was forwarded in time.
+ * @param user data passed back to the callback
+ *
+ * @return 0 if the request is tracked, negative otherwise
+ */
+int gb_operation_observe_request(uint8_t intf_id, uint16_t cport,
+				 const struct gb_operation_msg_hdr *hdr, uint32_t timeout_ms,
+				 gb_operation_callback_t callback, void *user_data);
+
+/*
+ * Match a forwarded response against the requests tracked by gb_operation_observe_request() and
+ * complete the operation it belongs to.
+ *
+ * @param interface the response is sent from
+ * @param cport of the interface
+ * @param greybus response. Ownership is not transferred.
+ *
+ * @return true if the response matched a tracked request
+ */
+bool gb_operation_observe_response(uint8_t intf_id, uint16_t cport, const struct gb_message *msg);
+
+/*
+ * Report a request that another originator, such as the AP, sends to an interface the bridge
+ * also sends requests to with gb_operation_send_request_via(). Operation ids are not shared
+ * between originators, so an outstanding operation of the same id and type is cancelled. The
+ * response then reaches the originator of the request.
+ *
+ * @param interface the request is sent to
+ * @param cport the request is sent to
+ * @param greybus request. Ownership is not transferred.
+ */
+void gb_operation_handle_foreign_request(uint8_t intf_id, uint16_t cport,
+					 const struct gb_message *msg);
+
+/*
+ * Cancel all outstanding operations of an interface. Callbacks are invoked with -ECANCELED.
+ *
+ * @param interface id
+ */
+void gb_operation_cancel_all(uint8_t intf_id);
+
+/*
+ * Cancel the outstanding operations of a connection and release its operation id state. Callbacks
+ * are invoked with -ECANCELED.
+ *
+ * @param interface id
+ * @param cport
+ */
+void gb_operation_connection_destroy(uint8_t intf_id, uint16_t cport);
+
+/*
+ * Start the workqueue that handles operation timeouts. Must be called before the first request is
+ * sent.
+ */
+void gb_operation_init(void);
+
+#endif
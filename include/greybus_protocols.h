@@ -18,6 +18,21 @@ typedef uint64_t __le64;
 #define GB_OP_RESPONSE   0x80
 #define GB_RESPONSE(req) (req | GB_OP_RESPONSE)
 
+/* Operation result, carried in the result field of response headers */
+enum gb_operation_result {
+	GB_OP_SUCCESS = 0x00,
+	GB_OP_INTERRUPTED = 0x01,
+	GB_OP_TIMEOUT = 0x02,
+	GB_OP_NO_MEMORY = 0x03,
+	GB_OP_PROTOCOL_BAD = 0x04,
+	GB_OP_OVERFLOW = 0x05,
+	GB_OP_INVALID = 0x06,
+	GB_OP_RETRY = 0x07,
+	GB_OP_NONEXISTENT = 0x08,
+	GB_OP_UNKNOWN_ERROR = 0xfe,
+	GB_OP_INTERNAL = 0xff,
+};
+
 /* Fixed IDs for control/svc protocols */
 
 /* SVC switch-port device ids */
@@ -76,6 +76,13 @@ uint32_t hdlc_rx_start(uint8_t **buffer);
  */
 int hdlc_rx_finish(uint32_t written);
 
+/*
+ * Check if the caller runs on the HDLC RX workqueue, which must not block
+ *
+ * @return true if called from the HDLC RX workqueue
+ */
+bool hdlc_rx_is_current(void);
+
 /*
  * Send a greybus message over HDLC
  *
@@ -90,7 +97,8 @@ static inline int gb_message_hdlc_send(struct gb_message *msg, uint16_t cport)
 	memcpy(&buffer[sizeof(struct gb_operation_msg_hdr) + sizeof(cport)], msg->payload,
 	       gb_message_payload_len(msg));
 
-	hdlc_block_send_sync(buffer, msg->header.size + sizeof(cport), ADDRESS_GREYBUS, 0x03);
+	hdlc_block_send_sync(buffer, sys_le16_to_cpu(msg->header.size) + sizeof(cport),
+			     ADDRESS_GREYBUS, 0x03);
 
 	return 0;
 }
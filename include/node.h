@@ -12,14 +12,118 @@
 #define GB_TRANSPORT_TCPIP_BASE_PORT 4242
 
 /*
- * Destroy a tcp greybus interface
+ * How the cports of a node are mapped to sockets
+ *
+ * NODE_TRANSPORT_TCP: all cports share one connection to GB_TRANSPORT_TCPIP_BASE_PORT, every
+ * message is prefixed with its cport.
+ * NODE_TRANSPORT_TCP_CPORT: one connection per cport to GB_TRANSPORT_TCPIP_BASE_PORT + cport,
+ * so that a busy cport does not delay the others.
+ * NODE_TRANSPORT_UDP: datagrams to GB_TRANSPORT_TCPIP_BASE_PORT, each holding one or more
+ * messages framed as with NODE_TRANSPORT_TCP. Lossy: nothing is retransmitted, a lost message
+ * fails its operation with a timeout on the AP.
+ */
+enum node_transport {
+	NODE_TRANSPORT_TCP,
+	NODE_TRANSPORT_TCP_CPORT,
+	NODE_TRANSPORT_UDP,
+};
+
+/*
+ * Transmit queue metrics of a node
+ *
+ * @param sent: messages sent
+ * @param writes: socket writes or datagrams the messages were sent with
+ * @param retries: send attempts retried after a transient failure
+ * @param drops: messages dropped because the queue was full
+ * @param oldest_age_ms: time the oldest queued message has been waiting
+ * @param max_age_ms: longest time a sent message waited in the queue
+ * @param depth: messages currently queued
+ * @param max_depth: highest number of queued messages
+ */
+struct node_tx_stats {
+	uint32_t sent;
+	uint32_t writes;
+	uint32_t retries;
+	uint32_t drops;
+	uint32_t oldest_age_ms;
+	uint32_t max_age_ms;
+	uint16_t depth;
+	uint16_t max_depth;
+};
+
+/*
+ * Heartbeat metrics of a node
+ *
+ * @param sent: heartbeats sent
+ * @param lost: heartbeats without response when the next one was due
+ * @param rtt_last_us: round trip time of the last answered heartbeat
+ * @param rtt_avg_us: moving average of the round trip time
+ * @param rtt_max_us: highest round trip time
+ */
+struct node_heartbeat_stats {
+	uint32_t sent;
+	uint32_t lost;
+	uint32_t rtt_last_us;
+	uint32_t rtt_avg_us;
+	uint32_t rtt_max_us;
+};
+
+/*
+ * Receive counters of a node RX thread. Sampling them twice gives the receive rate.
+ *
+ * @param messages: messages forwarded
+ * @param bytes: bytes received
+ * @param wakeups: returns from poll
+ * @param sockets: sockets polled
+ * @param shards: number of RX threads
+ */
+struct node_rx_stats {
+	uint32_t messages;
+	uint32_t bytes;
+	uint32_t wakeups;
+	uint16_t sockets;
+	uint8_t shards;
+};
+
+/*
+ * Initialize the node transport. Must be called once before any node is created.
+ */
+void node_init(void);
+
+/*
+ * Destroy a tcp greybus interface. The connections of the node are forgotten, the interface is
+ * freed once no read section can still use it.
  *
  * @return greybus interface
  */
 void node_destroy_interface(struct gb_interface *intf);
 
 /*
- * Find greybus node by interface ID
+ * Start a read section. Node interfaces found inside the section, by node_find_by_id() or through
+ * a connection, are not freed before it ends. Sections nest and must not block for long.
+ *
+ * @return key to pass to node_read_unlock()
+ */
+int node_read_lock(void);
+
+/*
+ * End a read section.
+ *
+ * @param key returned by node_read_lock()
+ */
+void node_read_unlock(int key);
+
+/*
+ * Check if the caller is a node RX thread. Those handle messages inside a read section, so they
+ * must not block.
+ *
+ * @return true if called from a node RX thread
+ */
+bool node_rx_is_current(void);
+
+/*
+ * Find greybus node by interface ID. Must be called inside a read section, the interface can be
+ * used until it ends.
  *
  * @param interface id
  *
@@ -27,13 +131,45 @@ void node_destroy_interface(struct gb_interface *intf);
  */
 struct gb_interface *node_find_by_id(uint8_t intf_id);
 
+/*
+ * Get the transmit queue metrics of a node
+ *
+ * @param interface id
+ * @param metrics
+ *
+ * @return 0 if successful, negative in case of error
+ */
+int node_tx_stats_get(uint8_t intf_id, struct node_tx_stats *stats);
+
+/*
+ * Get the heartbeat metrics of a node
+ *
+ * @param interface id
+ * @param metrics
+ *
+ * @return 0 if successful, negative in case of error
+ */
+int node_heartbeat_stats_get(uint8_t intf_id, struct node_heartbeat_stats *stats);
+
+/*
+ * Get the receive counters of a node RX thread
+ *
+ * @param RX thread index
+ * @param counters
+ *
+ * @return 0 if successful, negative in case of error
+ */
+int node_rx_stats_get(uint8_t shard, struct node_rx_stats *stats);
+
 /*
  * Checks if any new nodes have been added or any previous nodes removed.
  *
  * @param list of nodes discovered
+ * @param transport of each discovered node. NULL for NODE_TRANSPORT_TCP.
  * @param lenght of nodes list
  */
-void node_filter(struct in6_addr *active_addr, size_t active_len);
+void node_filter(const struct in6_addr *active_addr, const enum node_transport *transports,
+		 size_t active_len);
 
 /*
  * Destroy all current node interfaces.
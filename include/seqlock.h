@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+/*
+ * Sequence lock for tables that are read on every message and written rarely. Writers are
+ * serialized by a spinlock and bump the sequence number before and after the update. Readers take
+ * no lock, they copy what they need and retry if the sequence number changed meanwhile.
+ *
+ * Since writers hold a spinlock, a reader can never preempt a writer on a single core, so the
+ * read side never waits there.
+ *
+ * @param lock: serializes writers
+ * @param seq: odd while a write is in progress
+ */
+struct seqlock {
+	struct k_spinlock lock;
+	atomic_t seq;
+};
+
+/*
+ * Start a write section.
+ *
+ * @param seqlock
+ *
+ * @return key to pass to seqlock_write_unlock()
+ */
+static inline k_spinlock_key_t seqlock_write_lock(struct seqlock *sl)
+{
+	k_spinlock_key_t key = k_spin_lock(&sl->lock);
+
+	atomic_inc(&sl->seq);
+
+	return key;
+}
+
+/*
+ * End a write section.
+ *
+ * @param seqlock
+ * @param key returned by seqlock_write_lock()
+ */
+static inline void seqlock_write_unlock(struct seqlock *sl, k_spinlock_key_t key)
+{
+	atomic_inc(&sl->seq);
+	k_spin_unlock(&sl->lock, key);
+}
+
+/*
+ * Start a read section.
+ *
+ * @param seqlock
+ *
+ * @return sequence number to pass to seqlock_read_retry()
+ */
+static inline atomic_val_t seqlock_read_begin(const struct seqlock *sl)
+{
+	atomic_val_t seq;
+
+	/* Only possible with a writer running on another core */
+	while ((seq = atomic_get(&sl->seq)) & 1) {
+	}
+
+	return seq;
+}
+
+/*
+ * End a read section.
+ *
+ * @param seqlock
+ * @param sequence number returned by seqlock_read_begin()
+ *
+ * @return true if a write happened during the read section and it must be retried
+ */
+static inline bool seqlock_read_retry(const struct seqlock *sl, atomic_val_t seq)
+{
+	return atomic_get(&sl->seq) != seq;
+}
+
+#endif
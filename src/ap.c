@@ -5,22 +5,97 @@
 
 #include "ap.h"
 #include "hdlc.h"
+#include "node.h"
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
+#define AP_TX_QUEUE_DEPTH       CONFIG_BEAGLEPLAY_GREYBUS_AP_TX_QUEUE_DEPTH
+#define AP_TX_TIMEOUT_MS        CONFIG_BEAGLEPLAY_GREYBUS_AP_TX_TIMEOUT_MS
+#define AP_TX_THREAD_STACK_SIZE 1024
+#define AP_TX_THREAD_PRIORITY   5
+
 LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
+struct ap_tx_item {
+	struct gb_message *msg;
+	uint16_t cport;
+};
+
+static void ap_tx_thread_entry(void *p1, void *p2, void *p3);
+
+/* High priority cports are always drained first */
+K_MSGQ_DEFINE(ap_tx_high_prio_queue, sizeof(struct ap_tx_item), AP_TX_QUEUE_DEPTH, 4);
+K_MSGQ_DEFINE(ap_tx_queue, sizeof(struct ap_tx_item), AP_TX_QUEUE_DEPTH, 4);
+K_SEM_DEFINE(ap_tx_sem, 0, K_SEM_MAX_LIMIT);
+
+static atomic_t ap_tx_dropped;
+
+K_THREAD_DEFINE(ap_tx_thread, AP_TX_THREAD_STACK_SIZE, ap_tx_thread_entry, NULL, NULL, NULL,
+		AP_TX_THREAD_PRIORITY, 0, 0);
+
+static void ap_tx_thread_entry(void *p1, void *p2, void *p3)
+{
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	struct ap_tx_item item;
+
+	while (1) {
+		k_sem_take(&ap_tx_sem, K_FOREVER);
+
+		if (k_msgq_get(&ap_tx_high_prio_queue, &item, K_NO_WAIT) &&
+		    k_msgq_get(&ap_tx_queue, &item, K_NO_WAIT)) {
+			/* Queues were flushed by ap_deinit */
+			continue;
+		}
+
+		gb_message_hdlc_send(item.msg, item.cport);
+		connection_latency_tag(AP_INF_ID, item.cport, item.msg, CONNECTION_LATENCY_UART_TX);
+		gb_message_dealloc(item.msg);
+	}
+}
+
+static void ap_tx_queue_flush(struct k_msgq *queue)
+{
+	struct ap_tx_item item;
+
+	while (!k_msgq_get(queue, &item, K_NO_WAIT)) {
+		gb_message_dealloc(item.msg);
+	}
+}
+
 void ap_init(void)
 {
 }
 
 void ap_deinit(void)
 {
+	ap_tx_queue_flush(&ap_tx_high_prio_queue);
+	ap_tx_queue_flush(&ap_tx_queue);
 }
 
-int ap_send(struct gb_message *msg, uint16_t cport) {
-	int ret = gb_message_hdlc_send(msg, cport);
-	gb_message_dealloc(msg);
+int ap_send(struct gb_message *msg, uint16_t cport)
+{
+	struct ap_tx_item item = {.msg = msg, .cport = cport};
+	struct k_msgq *queue =
+		connection_is_high_prio(cport) ? &ap_tx_high_prio_queue : &ap_tx_queue;
+	bool may_block = !k_is_in_isr() && !hdlc_rx_is_current() && !node_rx_is_current();
+	int ret;
+
+	/*
+	 * Block the sender instead of dropping, the UART drains the queue at a steady rate. The
+	 * HDLC RX workqueue and the node RX threads, which hold a node read section, never wait.
+	 */
+	ret = k_msgq_put(queue, &item, may_block ? K_MSEC(AP_TX_TIMEOUT_MS) : K_NO_WAIT);
+	if (ret < 0) {
+		LOG_ERR("AP TX queue %s, dropping message for Cport %u (%ld dropped)",
+			may_block ? "stalled" : "full", cport, atomic_inc(&ap_tx_dropped) + 1);
+		gb_message_dealloc(msg);
+		return ret;
+	}
+
+	k_sem_give(&ap_tx_sem);
 
-	return ret;
+	return 0;
 }
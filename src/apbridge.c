@@ -6,58 +6,1005 @@
 #include "ap.h"
 #include "apbridge.h"
 #include "greybus_interfaces.h"
+#include "greybus_operations.h"
+#include "node.h"
+#include "seqlock.h"
+#include "svc.h"
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/math_extras.h>
+#include <zephyr/sys/util.h>
+
+#define MAX_LATENCY_TAGS      CONFIG_BEAGLEPLAY_GREYBUS_MAX_LATENCY_TAGS
+#define MAX_PEER_CONNECTIONS  CONFIG_BEAGLEPLAY_GREYBUS_MAX_PEER_CONNECTIONS
+#define LATENCY_TAG_IN_FLIGHT 4
+
+/* The route index is kept at most half full so that probe sequences stay short */
+#define NODE_ROUTE_INDEX_BITS (LOG2CEIL(AP_MAX_CPORTS + 2 * MAX_PEER_CONNECTIONS) + 1)
+#define NODE_ROUTE_INDEX_SIZE BIT(NODE_ROUTE_INDEX_BITS)
+#define NODE_ROUTE_INDEX_MASK (NODE_ROUTE_INDEX_SIZE - 1)
+
+/* Route of a node cport connected to another node cport, see node_route_entry */
+#define NODE_ROUTE_PEER BIT(15)
+
+/* Statistics of peer connections follow those of the AP cports */
+#define CONNECTION_STATS_PEER(peer) (AP_MAX_CPORTS + (peer))
+#define CONNECTION_STATS_SIZE       CONNECTION_STATS_PEER(MAX_PEER_CONNECTIONS)
+
+BUILD_ASSERT(AP_MAX_CPORTS < NODE_ROUTE_PEER, "AP cports must not collide with peer routes");
 
 LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
+/*
+ * Connection between an AP cport and a node cport. Kept to two words since the table has an entry
+ * for every AP cport.
+ *
+ * @param node_intf: node interface
+ * @param node_cport: cport of the node
+ * @param node_id: interface id of the node
+ * @param flags: GB_APB_CPORT_FLAG_* set by the AP for the AP cport
+ */
 struct node_ap_item {
 	struct gb_interface *node_intf;
 	uint16_t node_cport;
 	uint8_t node_id;
+	uint8_t flags;
+};
+
+BUILD_ASSERT(sizeof(struct node_ap_item) <= 2 * sizeof(void *));
+
+/*
+ * Connection between two cports behind the bridge, forwarded without going through the AP. A
+ * message from one end is delivered to the other.
+ *
+ * @param intf: interface of each end
+ * @param cport: cport of each end
+ */
+struct node_peer_item {
+	struct gb_interface *intf[2];
+	uint16_t cport[2];
+};
+
+/*
+ * Entry of the route index.
+ *
+ * @param key: node id and node cport
+ * @param route: AP cport + 1, or NODE_ROUTE_PEER | (peer connection << 1 | end). 0 if empty.
+ */
+struct node_route_entry {
+	uint32_t key;
+	uint16_t route;
+};
+
+/*
+ * Timestamps of a latency tagged request travelling through the bridge.
+ *
+ * @param cycles: cycle count at each connection_latency_stage
+ * @param operation_id: operation id of the request
+ * @param stage: last stage reached
+ * @param active: true if the entry is tracking a request
+ */
+struct latency_tag_item {
+	uint32_t cycles[CONNECTION_LATENCY_UART_TX];
+	uint16_t operation_id;
+	uint8_t stage;
+	bool active;
+};
+
+struct latency_tag {
+	struct latency_tag_item in_flight[LATENCY_TAG_IN_FLIGHT];
+	uint32_t histogram[CONNECTION_LATENCY_HOPS][CONNECTION_LATENCY_BUCKETS];
+	uint16_t ap_cport;
+	uint8_t next;
+	bool active;
 };
 
-static struct node_ap_item node_ap_map[AP_MAX_NODES] = {0};
+/* Routing tables. Read locklessly on every message, written on connection create and destroy */
+static struct seqlock node_ap_lock;
+static struct node_ap_item node_ap_map[AP_MAX_CPORTS] = {0};
+static struct node_peer_item node_peer_map[MAX_PEER_CONNECTIONS];
+
+/* Open addressing hash from (node id, node cport) to route, with linear probing */
+static struct node_route_entry node_route_index[NODE_ROUTE_INDEX_SIZE];
+
+static uint32_t node_route_key(uint8_t node_id, uint16_t node_cport)
+{
+	return ((uint32_t)node_id << 16) | node_cport;
+}
+
+static size_t node_route_hash(uint32_t key)
+{
+	/* Fibonacci hashing */
+	return (key * 2654435761U) >> (32 - NODE_ROUTE_INDEX_BITS);
+}
+
+/* Must be called with node_ap_lock held or in a read section */
+static uint16_t node_route_find(uint32_t key)
+{
+	size_t i = node_route_hash(key), probes;
+
+	/* Bounded, the index can change under a reader */
+	for (probes = 0; probes < NODE_ROUTE_INDEX_SIZE; ++probes) {
+		if (!node_route_index[i].route || node_route_index[i].key == key) {
+			return node_route_index[i].route;
+		}
+		i = (i + 1) & NODE_ROUTE_INDEX_MASK;
+	}
+
+	return 0;
+}
+
+/* Must be called with node_ap_lock held */
+static int node_route_add(uint32_t key, uint16_t route)
+{
+	size_t i = node_route_hash(key);
+
+	while (node_route_index[i].route) {
+		if (node_route_index[i].key == key) {
+			return -EALREADY;
+		}
+		i = (i + 1) & NODE_ROUTE_INDEX_MASK;
+	}
+
+	node_route_index[i].key = key;
+	node_route_index[i].route = route;
+
+	return 0;
+}
+
+/* Must be called with node_ap_lock held */
+static void node_route_remove(uint32_t key)
+{
+	size_t i = node_route_hash(key), j, home;
+
+	while (node_route_index[i].key != key) {
+		if (!node_route_index[i].route) {
+			return;
+		}
+		i = (i + 1) & NODE_ROUTE_INDEX_MASK;
+	}
+
+	if (!node_route_index[i].route) {
+		return;
+	}
+
+	/* Shift back later entries of the probe sequence instead of leaving a tombstone */
+	for (j = (i + 1) & NODE_ROUTE_INDEX_MASK; node_route_index[j].route;
+	     j = (j + 1) & NODE_ROUTE_INDEX_MASK) {
+		home = node_route_hash(node_route_index[j].key);
+		if (((j - home) & NODE_ROUTE_INDEX_MASK) >= ((j - i) & NODE_ROUTE_INDEX_MASK)) {
+			node_route_index[i] = node_route_index[j];
+			i = j;
+		}
+	}
+
+	node_route_index[i].route = 0;
+}
+
+static struct latency_tag latency_tags[MAX_LATENCY_TAGS];
+static struct k_spinlock latency_tags_lock;
+static atomic_t latency_tags_enabled = ATOMIC_INIT(0);
+
+/* Bounds checked lookup of the node connected to an AP cport */
+static bool node_ap_get(uint16_t ap_cport, struct node_ap_item *item)
+{
+	atomic_val_t seq;
+
+	if (ap_cport >= AP_MAX_CPORTS) {
+		return false;
+	}
+
+	do {
+		seq = seqlock_read_begin(&node_ap_lock);
+		*item = node_ap_map[ap_cport];
+	} while (seqlock_read_retry(&node_ap_lock, seq));
+
+	return item->node_intf != NULL;
+}
 
 static int node_ap_add(uint16_t ap_cport, uint16_t node_cport, struct gb_interface *node_intf)
 {
-	if (ap_cport >= AP_MAX_NODES) {
+	k_spinlock_key_t key;
+	int ret = 0;
+
+	if (ap_cport >= AP_MAX_CPORTS) {
 		return -E2BIG;
 	}
 
+	key = seqlock_write_lock(&node_ap_lock);
+
 	if (node_ap_map[ap_cport].node_intf) {
-		return -EALREADY;
+		ret = -EALREADY;
+		goto unlock;
+	}
+
+	/* Removed meanwhile. Checked under the lock, connection_forget_interface() comes after */
+	if (gb_interface_find_by_id(node_intf->id) != node_intf) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	ret = node_route_add(node_route_key(node_intf->id, node_cport), ap_cport + 1);
+	if (ret < 0) {
+		goto unlock;
 	}
 
 	node_ap_map[ap_cport].node_id = node_intf->id;
 	node_ap_map[ap_cport].node_cport = node_cport;
 	node_ap_map[ap_cport].node_intf = node_intf;
 
-	return 0;
+	/* Flags are set by the AP when enabling the cport, before the connection is created */
+	if (node_ap_map[ap_cport].flags & GB_APB_CPORT_FLAG_HIGH_PRIO) {
+		atomic_inc(&node_intf->high_prio_cports);
+	}
+
+unlock:
+	seqlock_write_unlock(&node_ap_lock, key);
+	return ret;
 }
 
-static int node_ap_remove(uint16_t ap_cport)
+/* Must be called with node_ap_lock held */
+static void node_ap_clear(uint16_t ap_cport)
 {
-	if (ap_cport >= AP_MAX_NODES) {
-		return -E2BIG;
+	if (node_ap_map[ap_cport].node_intf) {
+		node_route_remove(node_route_key(node_ap_map[ap_cport].node_id,
+						 node_ap_map[ap_cport].node_cport));
 	}
 
 	node_ap_map[ap_cport].node_id = 0;
 	node_ap_map[ap_cport].node_cport = 0;
 	node_ap_map[ap_cport].node_intf = NULL;
+	node_ap_map[ap_cport].flags = 0;
+}
+
+static int node_ap_remove(uint16_t ap_cport)
+{
+	k_spinlock_key_t key;
+
+	if (ap_cport >= AP_MAX_CPORTS) {
+		return -E2BIG;
+	}
+
+	key = seqlock_write_lock(&node_ap_lock);
+
+	if (node_ap_map[ap_cport].node_intf &&
+	    (node_ap_map[ap_cport].flags & GB_APB_CPORT_FLAG_HIGH_PRIO)) {
+		atomic_dec(&node_ap_map[ap_cport].node_intf->high_prio_cports);
+	}
+
+	node_ap_clear(ap_cport);
+
+	seqlock_write_unlock(&node_ap_lock, key);
 
 	return 0;
 }
 
+static int node_ap_set_flags(uint16_t ap_cport, const void *data, size_t data_len)
+{
+	const struct gb_apb_request_cport_flags *req = data;
+	struct gb_interface *intf;
+	k_spinlock_key_t key;
+	uint8_t flags;
+	bool was_high_prio, is_high_prio;
+
+	if (ap_cport >= AP_MAX_CPORTS) {
+		return -E2BIG;
+	}
+
+	if (data_len < sizeof(*req)) {
+		return -EINVAL;
+	}
+
+	flags = sys_le32_to_cpu(req->flags) &
+		(GB_APB_CPORT_FLAG_CONTROL | GB_APB_CPORT_FLAG_HIGH_PRIO);
+
+	key = seqlock_write_lock(&node_ap_lock);
+
+	was_high_prio = node_ap_map[ap_cport].flags & GB_APB_CPORT_FLAG_HIGH_PRIO;
+	is_high_prio = flags & GB_APB_CPORT_FLAG_HIGH_PRIO;
+	node_ap_map[ap_cport].flags = flags;
+
+	intf = node_ap_map[ap_cport].node_intf;
+	if (intf && was_high_prio != is_high_prio) {
+		if (is_high_prio) {
+			atomic_inc(&intf->high_prio_cports);
+		} else {
+			atomic_dec(&intf->high_prio_cports);
+		}
+	}
+
+	seqlock_write_unlock(&node_ap_lock, key);
+
+	LOG_DBG("Cport %u flags %X", ap_cport, flags);
+
+	return 0;
+}
+
+/* @return index of the peer connection (>= 0) if successful, negative in case of error */
+static int node_peer_add(struct gb_interface *intf1, uint16_t cport1, struct gb_interface *intf2,
+			 uint16_t cport2)
+{
+	uint32_t key1 = node_route_key(intf1->id, cport1), key2 = node_route_key(intf2->id, cport2);
+	k_spinlock_key_t key;
+	size_t i;
+	int ret;
+
+	key = seqlock_write_lock(&node_ap_lock);
+
+	if (gb_interface_find_by_id(intf1->id) != intf1 ||
+	    gb_interface_find_by_id(intf2->id) != intf2) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	for (i = 0; i < MAX_PEER_CONNECTIONS; ++i) {
+		if (!node_peer_map[i].intf[0]) {
+			break;
+		}
+	}
+
+	if (i == MAX_PEER_CONNECTIONS) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	ret = node_route_add(key1, NODE_ROUTE_PEER | (i << 1));
+	if (ret < 0) {
+		goto unlock;
+	}
+
+	ret = node_route_add(key2, NODE_ROUTE_PEER | (i << 1) | 1);
+	if (ret < 0) {
+		node_route_remove(key1);
+		goto unlock;
+	}
+
+	node_peer_map[i].intf[0] = intf1;
+	node_peer_map[i].cport[0] = cport1;
+	node_peer_map[i].intf[1] = intf2;
+	node_peer_map[i].cport[1] = cport2;
+	ret = i;
+
+unlock:
+	seqlock_write_unlock(&node_ap_lock, key);
+	return ret;
+}
+
+static void node_peer_remove(uint8_t intf1_id, uint16_t cport1, uint8_t intf2_id, uint16_t cport2)
+{
+	uint32_t key1 = node_route_key(intf1_id, cport1), key2 = node_route_key(intf2_id, cport2);
+	k_spinlock_key_t key;
+	uint16_t route;
+
+	key = seqlock_write_lock(&node_ap_lock);
+
+	route = node_route_find(key1);
+	if ((route & NODE_ROUTE_PEER) && node_route_find(key2) == (route ^ 1)) {
+		node_route_remove(key1);
+		node_route_remove(key2);
+		memset(&node_peer_map[(route & ~NODE_ROUTE_PEER) >> 1], 0,
+		       sizeof(struct node_peer_item));
+	}
+
+	seqlock_write_unlock(&node_ap_lock, key);
+}
+
 static int node_to_ap_cport(uint8_t node_id, uint16_t node_cport)
 {
-	for (size_t i = 0; i < AP_MAX_NODES; i++) {
-		if (node_ap_map[i].node_id == node_id && node_ap_map[i].node_cport == node_cport) {
-			return i;
+	uint32_t key = node_route_key(node_id, node_cport);
+	atomic_val_t seq;
+	uint16_t route;
+
+	do {
+		seq = seqlock_read_begin(&node_ap_lock);
+		route = node_route_find(key);
+	} while (seqlock_read_retry(&node_ap_lock, seq));
+
+	return (route && !(route & NODE_ROUTE_PEER)) ? route - 1 : -EINVAL;
+}
+
+/*
+ * Find the other end of a connection between two cports behind the bridge.
+ *
+ * @param node id
+ * @param node cport
+ * @param interface of the other end
+ * @param cport of the other end
+ * @param route of the node cport, see node_route_entry
+ *
+ * @return true if the node cport is connected to a peer
+ */
+static bool node_to_peer(uint8_t node_id, uint16_t node_cport, struct gb_interface **peer_intf,
+			 uint16_t *peer_cport, uint16_t *peer_route)
+{
+	uint32_t key = node_route_key(node_id, node_cport);
+	struct node_peer_item *peer;
+	atomic_val_t seq;
+	uint16_t route;
+	uint8_t end;
+
+	do {
+		seq = seqlock_read_begin(&node_ap_lock);
+		route = node_route_find(key);
+		if (route & NODE_ROUTE_PEER) {
+			peer = &node_peer_map[(route & ~NODE_ROUTE_PEER) >> 1];
+			end = !(route & 1);
+			*peer_intf = peer->intf[end];
+			*peer_cport = peer->cport[end];
+		}
+	} while (seqlock_read_retry(&node_ap_lock, seq));
+
+	*peer_route = route;
+	return (route & NODE_ROUTE_PEER) && *peer_intf;
+}
+
+#ifdef CONFIG_BEAGLEPLAY_GREYBUS_CONNECTION_STATS
+/*
+ * Traffic of a connection, indexed by AP cport like node_ap_map, then by peer connection like
+ * node_peer_map, see CONNECTION_STATS_PEER(). For a peer connection, TX is from its first end
+ * towards the second.
+ *
+ * @param tx_messages: messages sent from the AP to the node
+ * @param tx_bytes: bytes sent from the AP to the node
+ * @param rx_messages: messages sent from the node to the AP
+ * @param rx_bytes: bytes sent from the node to the AP
+ * @param drops: messages dropped for lack of a connection or queue space
+ * @param send_failures: messages the node transport failed to send
+ * @param latency: request to response latency histogram, fed by the operation tracker
+ */
+struct connection_stats {
+	uint32_t tx_messages;
+	uint32_t tx_bytes;
+	uint32_t rx_messages;
+	uint32_t rx_bytes;
+	uint32_t drops;
+	uint32_t send_failures;
+	uint32_t latency[CONNECTION_LATENCY_BUCKETS];
+};
+
+static struct connection_stats connection_stats[CONNECTION_STATS_SIZE];
+static struct k_spinlock connection_stats_lock;
+#endif
+
+enum connection_stats_event {
+	CONNECTION_STATS_SENT,
+	CONNECTION_STATS_DROPPED,
+	CONNECTION_STATS_FAILED,
+};
+
+static void latency_histogram_add_us(uint32_t *buckets, uint32_t us)
+{
+	size_t bucket = us ? 31 - u32_count_leading_zeros(us) : 0;
+
+	buckets[MIN(bucket, CONNECTION_LATENCY_BUCKETS - 1)]++;
+}
+
+static void latency_histogram_add(uint32_t *buckets, uint32_t cycles)
+{
+	latency_histogram_add_us(buckets, k_cyc_to_us_floor32(cycles));
+}
+
+static struct latency_tag *latency_tag_find(uint16_t ap_cport)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_LATENCY_TAGS; ++i) {
+		if (latency_tags[i].active && latency_tags[i].ap_cport == ap_cport) {
+			return &latency_tags[i];
 		}
 	}
 
-	return -EINVAL;
+	return NULL;
+}
+
+static int latency_tag_enable(uint16_t ap_cport)
+{
+	struct latency_tag *tag;
+	k_spinlock_key_t key;
+	size_t i;
+	int ret = 0;
+
+	key = k_spin_lock(&latency_tags_lock);
+
+	if (latency_tag_find(ap_cport)) {
+		ret = -EALREADY;
+		goto unlock;
+	}
+
+	for (i = 0; i < MAX_LATENCY_TAGS; ++i) {
+		if (!latency_tags[i].active) {
+			break;
+		}
+	}
+
+	if (i == MAX_LATENCY_TAGS) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	tag = &latency_tags[i];
+	memset(tag, 0, sizeof(*tag));
+	tag->ap_cport = ap_cport;
+	tag->active = true;
+	atomic_inc(&latency_tags_enabled);
+
+unlock:
+	k_spin_unlock(&latency_tags_lock, key);
+	return ret;
+}
+
+static int latency_tag_disable(uint16_t ap_cport)
+{
+	struct latency_tag *tag;
+	k_spinlock_key_t key;
+	int ret = 0;
+
+	key = k_spin_lock(&latency_tags_lock);
+
+	tag = latency_tag_find(ap_cport);
+	if (!tag) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	tag->active = false;
+	atomic_dec(&latency_tags_enabled);
+
+unlock:
+	k_spin_unlock(&latency_tags_lock, key);
+	return ret;
+}
+
+static int latency_tag_get(uint16_t ap_cport, const void *data, size_t data_len, void *resp,
+			   size_t resp_len)
+{
+	const struct apbridge_latency_tag_get_request *req = data;
+	struct apbridge_latency_tag_get_response *res = resp;
+	struct latency_tag *tag;
+	k_spinlock_key_t key;
+	size_t i;
+	int ret = sizeof(*res);
+
+	if (data_len < sizeof(*req) || req->hop >= CONNECTION_LATENCY_HOPS ||
+	    resp_len < sizeof(*res)) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&latency_tags_lock);
+
+	tag = latency_tag_find(ap_cport);
+	if (!tag) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	for (i = 0; i < CONNECTION_LATENCY_BUCKETS; ++i) {
+		res->buckets[i] = sys_cpu_to_le32(tag->histogram[req->hop][i]);
+	}
+
+unlock:
+	k_spin_unlock(&latency_tags_lock, key);
+	return ret;
+}
+
+static struct latency_tag_item *latency_tag_item_find(struct latency_tag *tag,
+						      uint16_t operation_id, uint8_t stage)
+{
+	size_t i;
+
+	for (i = 0; i < LATENCY_TAG_IN_FLIGHT; ++i) {
+		if (tag->in_flight[i].active && tag->in_flight[i].operation_id == operation_id &&
+		    tag->in_flight[i].stage == stage) {
+			return &tag->in_flight[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void latency_tag_record(struct latency_tag *tag, const struct gb_message *msg,
+			       enum connection_latency_stage stage, uint32_t now)
+{
+	struct latency_tag_item *item;
+	uint16_t operation_id = sys_le16_to_cpu(msg->header.operation_id);
+
+	/* Requests are tagged on the way to the node, responses on the way back */
+	if (gb_message_is_response(msg) != (stage >= CONNECTION_LATENCY_NODE_RX)) {
+		return;
+	}
+
+	if (stage == CONNECTION_LATENCY_UART_RX) {
+		/* Overwrite the oldest entry if the node never answered */
+		item = &tag->in_flight[tag->next];
+		tag->next = (tag->next + 1) % LATENCY_TAG_IN_FLIGHT;
+		item->operation_id = operation_id;
+		item->cycles[stage] = now;
+		item->stage = stage;
+		item->active = true;
+		return;
+	}
+
+	item = latency_tag_item_find(tag, operation_id, stage - 1);
+	if (!item) {
+		return;
+	}
+
+	switch (stage) {
+	case CONNECTION_LATENCY_NODE_TX:
+		latency_histogram_add(tag->histogram[CONNECTION_LATENCY_HOP_INGRESS],
+				      now - item->cycles[CONNECTION_LATENCY_UART_RX]);
+		break;
+	case CONNECTION_LATENCY_NODE_RX:
+		latency_histogram_add(tag->histogram[CONNECTION_LATENCY_HOP_NODE],
+				      now - item->cycles[CONNECTION_LATENCY_NODE_TX]);
+		break;
+	case CONNECTION_LATENCY_UART_TX:
+		latency_histogram_add(tag->histogram[CONNECTION_LATENCY_HOP_EGRESS],
+				      now - item->cycles[CONNECTION_LATENCY_NODE_RX]);
+		latency_histogram_add(tag->histogram[CONNECTION_LATENCY_HOP_TOTAL],
+				      now - item->cycles[CONNECTION_LATENCY_UART_RX]);
+		item->active = false;
+		return;
+	default:
+		return;
+	}
+
+	item->cycles[stage] = now;
+	item->stage = stage;
+}
+
+void connection_latency_tag(uint8_t intf_id, uint16_t intf_cport, const struct gb_message *msg,
+			    enum connection_latency_stage stage)
+{
+	struct latency_tag *tag;
+	k_spinlock_key_t key;
+	uint32_t now = k_cycle_get_32();
+	int ap_cport;
+
+	if (!atomic_get(&latency_tags_enabled)) {
+		return;
+	}
+
+	ap_cport = (intf_id == AP_INF_ID) ? intf_cport : node_to_ap_cport(intf_id, intf_cport);
+	if (ap_cport < 0) {
+		return;
+	}
+
+	key = k_spin_lock(&latency_tags_lock);
+	tag = latency_tag_find(ap_cport);
+	if (tag) {
+		latency_tag_record(tag, msg, stage, now);
+	}
+	k_spin_unlock(&latency_tags_lock, key);
+}
+
+#ifdef CONFIG_BEAGLEPLAY_GREYBUS_CONNECTION_STATS
+/*
+ * Count a message of a connection.
+ *
+ * @param statistics index, see struct connection_stats
+ * @param true if sent in the TX direction
+ * @param header of the message
+ * @param what happened to the message
+ */
+static void connection_stats_update(size_t idx, bool tx, const struct gb_operation_msg_hdr *hdr,
+				    enum connection_stats_event event)
+{
+	struct connection_stats *stats;
+	k_spinlock_key_t key;
+
+	if (idx >= CONNECTION_STATS_SIZE) {
+		return;
+	}
+
+	key = k_spin_lock(&connection_stats_lock);
+	stats = &connection_stats[idx];
+
+	switch (event) {
+	case CONNECTION_STATS_DROPPED:
+		stats->drops++;
+		goto unlock;
+	case CONNECTION_STATS_FAILED:
+		stats->send_failures++;
+		goto unlock;
+	default:
+		break;
+	}
+
+	if (tx) {
+		stats->tx_messages++;
+		stats->tx_bytes += sys_le16_to_cpu(hdr->size);
+	} else {
+		stats->rx_messages++;
+		stats->rx_bytes += sys_le16_to_cpu(hdr->size);
+	}
+
+unlock:
+	k_spin_unlock(&connection_stats_lock, key);
+}
+
+static void connection_stats_latency_done(const struct gb_operation *op,
+					  const struct gb_message *resp, int status)
+{
+	size_t idx = (uintptr_t)op->user_data;
+	k_spinlock_key_t key;
+
+	if (status < 0) {
+		return;
+	}
+
+	key = k_spin_lock(&connection_stats_lock);
+	latency_histogram_add_us(connection_stats[idx].latency, op->latency_us);
+	k_spin_unlock(&connection_stats_lock, key);
+}
+
+/*
+ * Time the requests of a connection through the operation tracker. Called before a message is
+ * passed on, while it is still valid.
+ *
+ * @param statistics index, see struct connection_stats
+ * @param interface the message is sent from
+ * @param cport of the sending interface
+ * @param interface the message is sent to
+ * @param cport of the receiving interface
+ * @param greybus message
+ */
+static void connection_stats_track(size_t idx, uint8_t intf_id, uint16_t intf_cport,
+				   uint8_t dest_id, uint16_t dest_cport,
+				   const struct gb_message *msg)
+{
+	/* Unidirectional operations have no response */
+	if (!msg->header.operation_id) {
+		return;
+	}
+
+	if (gb_message_is_response(msg)) {
+		gb_operation_observe_response(intf_id, intf_cport, msg);
+	} else {
+		gb_operation_observe_request(dest_id, dest_cport, &msg->header,
+					     GB_OPERATION_TIMEOUT_MS, connection_stats_latency_done,
+					     (void *)(uintptr_t)idx);
+	}
+}
+
+static int connection_stats_reset(size_t idx)
+{
+	k_spinlock_key_t key;
+
+	if (idx >= CONNECTION_STATS_SIZE) {
+		return -E2BIG;
+	}
+
+	key = k_spin_lock(&connection_stats_lock);
+	memset(&connection_stats[idx], 0, sizeof(connection_stats[idx]));
+	k_spin_unlock(&connection_stats_lock, key);
+
+	return 0;
+}
+
+/*
+ * Fill an APBRIDGE_REQUEST_STATS_GET response.
+ *
+ * @param statistics index, see struct connection_stats
+ * @param true to report the RX direction as TX and the other way round
+ * @param node id of the far end
+ * @param node cport of the far end
+ * @param response
+ *
+ * @return size of the response
+ */
+static int connection_stats_fill(size_t idx, bool swap, uint8_t node_id, uint16_t node_cport,
+				 struct apbridge_stats_get_response *res)
+{
+	struct connection_stats stats;
+	k_spinlock_key_t key;
+	size_t i;
+
+	key = k_spin_lock(&connection_stats_lock);
+	stats = connection_stats[idx];
+	k_spin_unlock(&connection_stats_lock, key);
+
+	res->tx_messages = sys_cpu_to_le32(swap ? stats.rx_messages : stats.tx_messages);
+	res->tx_bytes = sys_cpu_to_le32(swap ? stats.rx_bytes : stats.tx_bytes);
+	res->rx_messages = sys_cpu_to_le32(swap ? stats.tx_messages : stats.rx_messages);
+	res->rx_bytes = sys_cpu_to_le32(swap ? stats.tx_bytes : stats.rx_bytes);
+	res->drops = sys_cpu_to_le32(stats.drops);
+	res->send_failures = sys_cpu_to_le32(stats.send_failures);
+	for (i = 0; i < CONNECTION_LATENCY_BUCKETS; ++i) {
+		res->latency_buckets[i] = sys_cpu_to_le32(stats.latency[i]);
+	}
+	res->node_cport = sys_cpu_to_le16(node_cport);
+	res->node_id = node_id;
+
+	return sizeof(*res);
+}
+
+static int connection_stats_get(uint16_t ap_cport, void *resp, size_t resp_len)
+{
+	struct node_ap_item item;
+
+	if (ap_cport >= AP_MAX_CPORTS) {
+		return -E2BIG;
+	}
+
+	if (resp_len < sizeof(struct apbridge_stats_get_response)) {
+		return -EINVAL;
+	}
+
+	if (!node_ap_get(ap_cport, &item)) {
+		item.node_id = 0;
+		item.node_cport = 0;
+	}
+
+	return connection_stats_fill(ap_cport, false, item.node_id, item.node_cport, resp);
+}
+
+static int connection_peer_stats_get(const void *data, size_t data_len, void *resp,
+				     size_t resp_len)
+{
+	const struct apbridge_peer_stats_get_request *req = data;
+	struct gb_interface *peer_intf;
+	uint16_t peer_cport, route;
+	uint8_t peer_id;
+	int key;
+
+	if (data_len < sizeof(*req) || resp_len < sizeof(struct apbridge_stats_get_response)) {
+		return -EINVAL;
+	}
+
+	/* The peer interface is only used inside the read section */
+	key = node_read_lock();
+	if (!node_to_peer(req->intf_id, sys_le16_to_cpu(req->cport), &peer_intf, &peer_cport,
+			  &route)) {
+		node_read_unlock(key);
+		return -ENOTCONN;
+	}
+	peer_id = peer_intf->id;
+	node_read_unlock(key);
+
+	/* TX is counted from the first end of the connection */
+	return connection_stats_fill(CONNECTION_STATS_PEER((route & ~NODE_ROUTE_PEER) >> 1),
+				     route & 1, peer_id, peer_cport, resp);
+}
+#else
+static inline void connection_stats_update(size_t idx, bool tx,
+					   const struct gb_operation_msg_hdr *hdr,
+					   enum connection_stats_event event)
+{
+}
+
+static inline void connection_stats_track(size_t idx, uint8_t intf_id, uint16_t intf_cport,
+					  uint8_t dest_id, uint16_t dest_cport,
+					  const struct gb_message *msg)
+{
+}
+
+static inline int connection_stats_reset(size_t idx)
+{
+	return -ENOTSUP;
+}
+
+static inline int connection_stats_get(uint16_t ap_cport, void *resp, size_t resp_len)
+{
+	return -ENOTSUP;
+}
+
+static inline int connection_peer_stats_get(const void *data, size_t data_len, void *resp,
+					    size_t resp_len)
+{
+	return -ENOTSUP;
+}
+#endif
+
+static int node_tx_stats_request(const void *data, size_t data_len, void *resp, size_t resp_len)
+{
+	const struct apbridge_node_tx_stats_get_request *req = data;
+	struct apbridge_node_tx_stats_get_response *res = resp;
+	struct node_tx_stats stats;
+	int ret;
+
+	if (data_len < sizeof(*req) || resp_len < sizeof(*res)) {
+		return -EINVAL;
+	}
+
+	ret = node_tx_stats_get(req->intf_id, &stats);
+	if (ret < 0) {
+		return ret;
+	}
+
+	res->sent = sys_cpu_to_le32(stats.sent);
+	res->retries = sys_cpu_to_le32(stats.retries);
+	res->drops = sys_cpu_to_le32(stats.drops);
+	res->oldest_age_ms = sys_cpu_to_le32(stats.oldest_age_ms);
+	res->max_age_ms = sys_cpu_to_le32(stats.max_age_ms);
+	res->depth = sys_cpu_to_le16(stats.depth);
+	res->max_depth = sys_cpu_to_le16(stats.max_depth);
+	res->writes = sys_cpu_to_le32(stats.writes);
+
+	return sizeof(*res);
+}
+
+static int node_heartbeat_request(const void *data, size_t data_len, void *resp, size_t resp_len)
+{
+	const struct apbridge_node_heartbeat_get_request *req = data;
+	struct apbridge_node_heartbeat_get_response *res = resp;
+	struct node_heartbeat_stats stats;
+	int ret;
+
+	if (data_len < sizeof(*req) || resp_len < sizeof(*res)) {
+		return -EINVAL;
+	}
+
+	ret = node_heartbeat_stats_get(req->intf_id, &stats);
+	if (ret < 0) {
+		return ret;
+	}
+
+	res->sent = sys_cpu_to_le32(stats.sent);
+	res->lost = sys_cpu_to_le32(stats.lost);
+	res->rtt_last_us = sys_cpu_to_le32(stats.rtt_last_us);
+	res->rtt_avg_us = sys_cpu_to_le32(stats.rtt_avg_us);
+	res->rtt_max_us = sys_cpu_to_le32(stats.rtt_max_us);
+
+	return sizeof(*res);
+}
+
+static int node_rx_stats_request(const void *data, size_t data_len, void *resp, size_t resp_len)
+{
+	const struct apbridge_node_rx_stats_get_request *req = data;
+	struct apbridge_node_rx_stats_get_response *res = resp;
+	struct node_rx_stats stats;
+	int ret;
+
+	if (data_len < sizeof(*req) || resp_len < sizeof(*res)) {
+		return -EINVAL;
+	}
+
+	ret = node_rx_stats_get(req->shard, &stats);
+	if (ret < 0) {
+		return ret;
+	}
+
+	res->messages = sys_cpu_to_le32(stats.messages);
+	res->bytes = sys_cpu_to_le32(stats.bytes);
+	res->wakeups = sys_cpu_to_le32(stats.wakeups);
+	res->sockets = sys_cpu_to_le16(stats.sockets);
+	res->shards = stats.shards;
+
+	return sizeof(*res);
+}
+
+int apbridge_control_request(uint8_t request, uint16_t cport, const void *data, size_t data_len,
+			     void *resp, size_t resp_len)
+{
+	switch (request) {
+	case GB_APB_REQUEST_LATENCY_TAG_EN:
+		LOG_DBG("Enable latency tag on Cport %u", cport);
+		return latency_tag_enable(cport);
+	case GB_APB_REQUEST_LATENCY_TAG_DIS:
+		LOG_DBG("Disable latency tag on Cport %u", cport);
+		return latency_tag_disable(cport);
+	case APBRIDGE_REQUEST_LATENCY_TAG_GET:
+		return latency_tag_get(cport, data, data_len, resp, resp_len);
+	case GB_APB_REQUEST_CPORT_FLAGS:
+		return node_ap_set_flags(cport, data, data_len);
+	case APBRIDGE_REQUEST_STATS_GET:
+		return connection_stats_get(cport, resp, resp_len);
+	case APBRIDGE_REQUEST_STATS_RESET:
+		LOG_DBG("Reset statistics of Cport %u", cport);
+		return cport < AP_MAX_CPORTS ? connection_stats_reset(cport) : -E2BIG;
+	case APBRIDGE_REQUEST_NODE_TX_STATS_GET:
+		return node_tx_stats_request(data, data_len, resp, resp_len);
+	case APBRIDGE_REQUEST_NODE_HEARTBEAT_GET:
+		return node_heartbeat_request(data, data_len, resp, resp_len);
+	case APBRIDGE_REQUEST_NODE_RX_STATS_GET:
+		return node_rx_stats_request(data, data_len, resp, resp_len);
+	case APBRIDGE_REQUEST_PEER_STATS_GET:
+		return connection_peer_stats_get(data, data_len, resp, resp_len);
+	default:
+		LOG_WRN("Unsupported APBridge request %X", request);
+		return -ENOTSUP;
+	}
 }
 
 void apbridge_init(void)
@@ -66,15 +1013,107 @@ void apbridge_init(void)
 
 void apbridge_deinit(void)
 {
-	for (size_t i = 0; i < AP_MAX_NODES; ++i) {
+	k_spinlock_key_t key;
+
+	key = seqlock_write_lock(&node_ap_lock);
+	for (size_t i = 0; i < AP_MAX_CPORTS; ++i) {
 		node_ap_map[i].node_id = 0;
 		node_ap_map[i].node_cport = 0;
 		node_ap_map[i].node_intf = NULL;
+		node_ap_map[i].flags = 0;
+	}
+	memset(node_peer_map, 0, sizeof(node_peer_map));
+	memset(node_route_index, 0, sizeof(node_route_index));
+	seqlock_write_unlock(&node_ap_lock, key);
+
+	key = k_spin_lock(&latency_tags_lock);
+	for (size_t i = 0; i < MAX_LATENCY_TAGS; ++i) {
+		latency_tags[i].active = false;
+	}
+	atomic_clear(&latency_tags_enabled);
+	k_spin_unlock(&latency_tags_lock, key);
+
+	/* Forwarded requests the AP was to answer are timed no longer */
+	gb_operation_cancel_all(AP_INF_ID);
+	for (size_t i = 0; i < CONNECTION_STATS_SIZE; ++i) {
+		connection_stats_reset(i);
 	}
 }
 
-int connection_create(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
-		      uint16_t intf2_cport)
+static int connection_create_peer(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
+				  uint16_t intf2_cport)
+{
+	struct gb_interface *intf1, *intf2;
+	int ret;
+
+	if (intf1_id == SVC_INF_ID || intf2_id == SVC_INF_ID) {
+		LOG_ERR("SVC can only be connected to the AP");
+		return -EINVAL;
+	}
+
+	intf1 = gb_interface_find_by_id(intf1_id);
+	intf2 = gb_interface_find_by_id(intf2_id);
+	if (!intf1 || !intf2) {
+		LOG_ERR("Failed to find node interface");
+		return -EINVAL;
+	}
+
+	ret = intf1->create_connection(intf1, intf1_cport);
+	if (ret < 0) {
+		LOG_ERR("Failed to create node connection");
+		return ret;
+	}
+
+	ret = intf2->create_connection(intf2, intf2_cport);
+	if (ret < 0) {
+		LOG_ERR("Failed to create node connection");
+		goto destroy_intf1;
+	}
+
+	ret = node_peer_add(intf1, intf1_cport, intf2, intf2_cport);
+	if (ret < 0) {
+		LOG_ERR("Failed to add node to node connection");
+		goto destroy_intf2;
+	}
+
+	connection_stats_reset(CONNECTION_STATS_PEER(ret));
+
+	return 0;
+
+destroy_intf2:
+	intf2->destroy_connection(intf2, intf2_cport);
+destroy_intf1:
+	intf1->destroy_connection(intf1, intf1_cport);
+	return ret;
+}
+
+static int connection_destroy_peer(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
+				   uint16_t intf2_cport)
+{
+	struct gb_interface *intf;
+
+	node_peer_remove(intf1_id, intf1_cport, intf2_id, intf2_cport);
+
+	/* Ignore interfaces that have already been cleaned up */
+	intf = gb_interface_find_by_id(intf1_id);
+	if (intf) {
+		intf->destroy_connection(intf, intf1_cport);
+	}
+
+	intf = gb_interface_find_by_id(intf2_id);
+	if (intf) {
+		intf->destroy_connection(intf, intf2_cport);
+	}
+
+	gb_operation_connection_destroy(intf1_id, intf1_cport);
+	gb_operation_connection_destroy(intf2_id, intf2_cport);
+
+	return 0;
+}
+
+/* Must be called inside a node read section, see connection_create() */
+static int connection_create_route(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
+				   uint16_t intf2_cport)
 {
 	struct gb_interface *intf;
 	uint8_t node_id;
@@ -90,8 +1129,7 @@ int connection_create(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
 		node_cport = intf1_cport;
 		ap_cport = intf2_cport;
 	} else {
-		LOG_ERR("Cannot create connection between two non-AP");
-		return -EINVAL;
+		return connection_create_peer(intf1_id, intf1_cport, intf2_id, intf2_cport);
 	}
 
 	intf = gb_interface_find_by_id(node_id);
@@ -109,14 +1147,34 @@ int connection_create(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
 	ret = node_ap_add(ap_cport, node_cport, intf);
 	if (ret < 0) {
 		LOG_ERR("Failed to add AP to node");
-		return ret;
+		goto destroy_intf;
 	}
 
+	connection_stats_reset(ap_cport);
+
 	return 0;
+
+destroy_intf:
+	intf->destroy_connection(intf, node_cport);
+	return ret;
 }
 
-int connection_destroy(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
-		       uint16_t intf2_cport)
+int connection_create(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
+		      uint16_t intf2_cport)
+{
+	int key, ret;
+
+	/* The interfaces must not be freed while their connection is set up */
+	key = node_read_lock();
+	ret = connection_create_route(intf1_id, intf1_cport, intf2_id, intf2_cport);
+	node_read_unlock(key);
+
+	return ret;
+}
+
+/* Must be called inside a node read section, see connection_destroy() */
+static int connection_destroy_route(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
+				    uint16_t intf2_cport)
 {
 	uint8_t node_id;
 	uint16_t ap_cport, node_cport;
@@ -131,8 +1189,7 @@ int connection_destroy(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
 		node_cport = intf1_cport;
 		ap_cport = intf2_cport;
 	} else {
-		LOG_ERR("Cannot destroy connection between two non-AP");
-		return -EINVAL;
+		return connection_destroy_peer(intf1_id, intf1_cport, intf2_id, intf2_cport);
 	}
 
 	intf = gb_interface_find_by_id(node_id);
@@ -142,28 +1199,131 @@ int connection_destroy(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
 	}
 
 	node_ap_remove(ap_cport);
+	gb_operation_connection_destroy(node_id, node_cport);
+	gb_operation_connection_destroy(AP_INF_ID, ap_cport);
 
 	return 0;
 }
 
-int connection_send(uint8_t intf_id, uint16_t intf_cport, struct gb_message *msg)
+int connection_destroy(uint8_t intf1_id, uint16_t intf1_cport, uint8_t intf2_id,
+		       uint16_t intf2_cport)
 {
-	struct gb_interface *intf;
-	int ret;
+	int key, ret;
+
+	key = node_read_lock();
+	ret = connection_destroy_route(intf1_id, intf1_cport, intf2_id, intf2_cport);
+	node_read_unlock(key);
+
+	return ret;
+}
+
+bool connection_is_high_prio(uint16_t ap_cport)
+{
+	return ap_cport < AP_MAX_CPORTS &&
+	       (node_ap_map[ap_cport].flags & GB_APB_CPORT_FLAG_HIGH_PRIO);
+}
+
+bool connection_node_is_high_prio(uint8_t node_id, uint16_t node_cport)
+{
+	int ap_cport = node_to_ap_cport(node_id, node_cport);
+
+	return ap_cport >= 0 && connection_is_high_prio(ap_cport);
+}
+
+/* Must be called inside a node read section, see connection_send() */
+static int connection_route(uint8_t intf_id, uint16_t intf_cport, struct gb_message *msg)
+{
+	/* The message is freed by the transport, keep what the statistics need */
+	struct gb_operation_msg_hdr hdr = msg->header;
+	struct node_ap_item item;
+	struct gb_interface *peer_intf;
+	uint16_t peer_cport, route;
+	size_t peer_idx;
+	int ret, ap_cport;
 
 	if (intf_id == AP_INF_ID) {
-		intf = node_ap_map[intf_cport].node_intf;
-		ret = intf->write(intf, msg, node_ap_map[intf_cport].node_cport);
-	} else {
-		ret = node_to_ap_cport(intf_id, intf_cport);
-		if (ret < 0) {
-			LOG_ERR("Failed to find AP cport");
-			goto early_exit;
+		if (!node_ap_get(intf_cport, &item)) {
+			LOG_ERR("No connection on AP Cport %u", intf_cport);
+			if (intf_cport < AP_MAX_CPORTS) {
+				connection_stats_update(intf_cport, true, &hdr,
+							CONNECTION_STATS_DROPPED);
+			}
+			ret = -ENOTCONN;
+			goto free_msg;
 		}
 
-		ret = ap_send(msg, ret);
+		connection_stats_track(intf_cport, intf_id, intf_cport, item.node_intf->id,
+				       item.node_cport, msg);
+		ret = item.node_intf->write(item.node_intf, msg, item.node_cport);
+		connection_stats_update(intf_cport, true, &hdr,
+					ret < 0 ? CONNECTION_STATS_FAILED : CONNECTION_STATS_SENT);
+		return ret;
+	}
+
+	ap_cport = node_to_ap_cport(intf_id, intf_cport);
+	if (ap_cport < 0 && node_to_peer(intf_id, intf_cport, &peer_intf, &peer_cport, &route)) {
+		peer_idx = CONNECTION_STATS_PEER((route & ~NODE_ROUTE_PEER) >> 1);
+		connection_stats_track(peer_idx, intf_id, intf_cport, peer_intf->id, peer_cport,
+				       msg);
+		ret = peer_intf->write(peer_intf, msg, peer_cport);
+		connection_stats_update(peer_idx, !(route & 1), &hdr,
+					ret < 0 ? CONNECTION_STATS_FAILED : CONNECTION_STATS_SENT);
+		return ret;
+	}
+
+	if (ap_cport < 0) {
+		LOG_ERR("Failed to find AP cport");
+		ret = ap_cport;
+		goto free_msg;
 	}
 
-early_exit:
+	connection_stats_track(ap_cport, intf_id, intf_cport, AP_INF_ID, ap_cport, msg);
+	ret = ap_send(msg, ap_cport);
+	connection_stats_update(ap_cport, false, &hdr,
+				ret < 0 ? CONNECTION_STATS_DROPPED : CONNECTION_STATS_SENT);
 	return ret;
+
+free_msg:
+	gb_message_dealloc(msg);
+	return ret;
+}
+
+int connection_send(uint8_t intf_id, uint16_t intf_cport, struct gb_message *msg)
+{
+	int key, ret;
+
+	/* Interfaces found in the routing tables are used after the lookup */
+	key = node_read_lock();
+	ret = connection_route(intf_id, intf_cport, msg);
+	node_read_unlock(key);
+
+	return ret;
+}
+
+void connection_forget_interface(struct gb_interface *intf)
+{
+	k_spinlock_key_t key;
+	size_t i, end;
+
+	key = seqlock_write_lock(&node_ap_lock);
+
+	for (i = 0; i < AP_MAX_CPORTS; ++i) {
+		if (node_ap_map[i].node_intf == intf) {
+			node_ap_clear(i);
+		}
+	}
+
+	for (i = 0; i < MAX_PEER_CONNECTIONS; ++i) {
+		if (node_peer_map[i].intf[0] != intf && node_peer_map[i].intf[1] != intf) {
+			continue;
+		}
+
+		for (end = 0; end < 2; ++end) {
+			node_route_remove(node_route_key(node_peer_map[i].intf[end]->id,
+							 node_peer_map[i].cport[end]));
+		}
+		memset(&node_peer_map[i], 0, sizeof(struct node_peer_item));
+	}
+
+	seqlock_write_unlock(&node_ap_lock, key);
 }
@@ -48,6 +48,7 @@ struct gb_interface *gb_interface_alloc(gb_controller_write_callback_t write_cb,
 	intf->create_connection = create_connection;
 	intf->destroy_connection = destroy_connection;
 	intf->ctrl_data = ctrl_data;
+	atomic_clear(&intf->high_prio_cports);
 
 	return intf;
 }
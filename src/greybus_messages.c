@@ -7,23 +7,9 @@
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
-#define OPERATION_ID_START 1
-
 LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 K_HEAP_DEFINE(greybus_messages_heap, CONFIG_BEAGLEPLAY_GREYBUS_MESSAGES_HEAP_MEM_POOL_SIZE);
 
-static atomic_t operation_id_counter = ATOMIC_INIT(OPERATION_ID_START);
-
-static uint16_t new_operation_id(void)
-{
-	atomic_val_t temp = atomic_inc(&operation_id_counter);
-
-	if (temp == UINT16_MAX) {
-		atomic_set(&operation_id_counter, OPERATION_ID_START);
-	}
-	return temp;
-}
-
 struct gb_message *gb_message_alloc(size_t payload_len, uint8_t message_type, uint16_t operation_id,
 				    uint8_t status)
 {
@@ -36,8 +22,8 @@ struct gb_message *gb_message_alloc(size_t payload_len, uint8_t message_type, ui
 		return NULL;
 	}
 
-	msg->header.size = sizeof(struct gb_operation_msg_hdr) + payload_len;
-	msg->header.operation_id = operation_id;
+	msg->header.size = sys_cpu_to_le16(sizeof(struct gb_operation_msg_hdr) + payload_len);
+	msg->header.operation_id = sys_cpu_to_le16(operation_id);
 	msg->header.type = message_type;
 	msg->header.result = status;
 
@@ -49,13 +35,26 @@ void gb_message_dealloc(struct gb_message *msg)
 	k_heap_free(&greybus_messages_heap, msg);
 }
 
-struct gb_message *gb_message_request_alloc(const void *payload, size_t payload_len,
-					    uint8_t request_type, bool is_oneshot)
+struct gb_message *gb_message_copy(const struct gb_message *msg)
 {
-	uint16_t operation_id = is_oneshot ? 0 : new_operation_id();
+	struct gb_message *copy;
 
-	struct gb_message *msg = gb_message_alloc(payload_len, request_type, operation_id, 0);
+	copy = gb_message_alloc(gb_message_payload_len(msg), msg->header.type,
+				sys_le16_to_cpu(msg->header.operation_id), msg->header.result);
+	if (copy) {
+		memcpy(copy->payload, msg->payload, gb_message_payload_len(msg));
+	}
+
+	return copy;
+}
 
-	memcpy(msg->payload, payload, payload_len);
+struct gb_message *gb_message_request_alloc(const void *payload, size_t payload_len,
+					    uint8_t request_type)
+{
+	struct gb_message *msg = gb_message_alloc(payload_len, request_type, 0, 0);
+
+	if (msg) {
+		memcpy(msg->payload, payload, payload_len);
+	}
 	return msg;
 }
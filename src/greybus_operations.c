@@ -0,0 +1,687 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#include "greybus_operations.h"
+#include "apbridge.h"
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/math_extras.h>
+#include <zephyr/sys/util.h>
+
+#define MAX_GREYBUS_OPERATIONS    CONFIG_BEAGLEPLAY_GREYBUS_MAX_OPERATIONS
+#define MAX_OPERATION_CONNECTIONS CONFIG_BEAGLEPLAY_GREYBUS_OPERATION_CONNECTIONS
+
+/*
+ * Number of operation ids tracked per connection. An id maps to window position id % WINDOW, so
+ * skipping occupied positions guarantees that no id is handed out twice while in flight.
+ */
+#define OPERATION_WINDOW 32
+
+/* The connection index is kept at most half full so that probe sequences stay short */
+#define OPERATION_INDEX_BITS (LOG2CEIL(MAX_OPERATION_CONNECTIONS) + 1)
+#define OPERATION_INDEX_SIZE BIT(OPERATION_INDEX_BITS)
+#define OPERATION_INDEX_MASK (OPERATION_INDEX_SIZE - 1)
+
+/* Forwarded requests must leave operation slots and connections to the bridge's own requests */
+#define MAX_OBSERVED_OPERATIONS (MIN(MAX_GREYBUS_OPERATIONS, MAX_OPERATION_CONNECTIONS) / 2)
+
+#define OPERATION_WORKQUEUE_STACK_SIZE 2048
+#define OPERATION_WORKQUEUE_PRIORITY   5
+
+LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
+
+BUILD_ASSERT(MAX_GREYBUS_OPERATIONS <= 32, "Operation slots are tracked in a 32 bit mask");
+BUILD_ASSERT(MAX_OPERATION_CONNECTIONS < UINT8_MAX, "Connections are indexed by uint8_t");
+
+/*
+ * An operation slot.
+ *
+ * @param op: the operation
+ * @param gen: allocation generation, tells a reused slot apart
+ * @param conn: connection the operation id was allocated from
+ */
+struct gb_operation_slot {
+	struct gb_operation op;
+	uint32_t gen;
+	uint8_t conn;
+};
+
+/*
+ * Operation id state of a connection.
+ *
+ * @param in_flight: window positions with an outstanding operation
+ * @param next_id: next candidate operation id
+ * @param cport: cport of the originating interface
+ * @param intf_id: originating interface
+ * @param active: true if the entry is in use
+ * @param slots: window position to operation slot
+ */
+struct gb_operation_connection {
+	uint32_t in_flight;
+	uint16_t next_id;
+	uint16_t cport;
+	uint8_t intf_id;
+	bool active;
+	uint8_t slots[OPERATION_WINDOW];
+};
+
+/*
+ * Entry of the connection index.
+ *
+ * @param key: interface id and cport, see gb_operation_connection_key()
+ * @param conn: position in connections plus one, 0 if the entry is empty
+ */
+struct gb_operation_index_entry {
+	uint32_t key;
+	uint8_t conn;
+};
+
+static void gb_operation_timeout_handler(struct k_work *work);
+
+static struct gb_operation_slot operations[MAX_GREYBUS_OPERATIONS];
+static uint32_t operations_used;
+static uint32_t operations_gen;
+static uint8_t operations_observed;
+static struct gb_operation_connection connections[MAX_OPERATION_CONNECTIONS];
+static struct k_spinlock operations_lock;
+
+/* Open addressing hash from (interface id, cport) to active connection, with linear probing */
+static struct gb_operation_index_entry connections_index[OPERATION_INDEX_SIZE];
+
+K_WORK_DELAYABLE_DEFINE(gb_operation_timeout_work, gb_operation_timeout_handler);
+K_THREAD_STACK_DEFINE(gb_operation_workqueue_stack, OPERATION_WORKQUEUE_STACK_SIZE);
+
+/* Timeouts, retransmissions and their callbacks. Kept off the system workqueue */
+static struct k_work_q gb_operation_workqueue;
+
+static uint32_t gb_operation_connection_key(uint8_t intf_id, uint16_t cport)
+{
+	return ((uint32_t)intf_id << 16) | cport;
+}
+
+static size_t gb_operation_index_hash(uint32_t key)
+{
+	/* Fibonacci hashing */
+	return (key * 2654435761U) >> (32 - OPERATION_INDEX_BITS);
+}
+
+/* Must be called with operations_lock held */
+static struct gb_operation_connection *gb_operation_index_find(uint32_t key)
+{
+	size_t i = gb_operation_index_hash(key);
+
+	while (connections_index[i].conn) {
+		if (connections_index[i].key == key) {
+			return &connections[connections_index[i].conn - 1];
+		}
+		i = (i + 1) & OPERATION_INDEX_MASK;
+	}
+
+	return NULL;
+}
+
+/* Must be called with operations_lock held. The key must not be in the index yet. */
+static void gb_operation_index_add(uint32_t key, const struct gb_operation_connection *conn)
+{
+	size_t i = gb_operation_index_hash(key);
+
+	while (connections_index[i].conn) {
+		i = (i + 1) & OPERATION_INDEX_MASK;
+	}
+
+	connections_index[i].key = key;
+	connections_index[i].conn = conn - connections + 1;
+}
+
+/* Must be called with operations_lock held */
+static void gb_operation_index_remove(uint32_t key)
+{
+	size_t i = gb_operation_index_hash(key), j, home;
+
+	while (connections_index[i].key != key) {
+		if (!connections_index[i].conn) {
+			return;
+		}
+		i = (i + 1) & OPERATION_INDEX_MASK;
+	}
+
+	if (!connections_index[i].conn) {
+		return;
+	}
+
+	/* Shift back later entries of the probe sequence instead of leaving a tombstone */
+	for (j = (i + 1) & OPERATION_INDEX_MASK; connections_index[j].conn;
+	     j = (j + 1) & OPERATION_INDEX_MASK) {
+		home = gb_operation_index_hash(connections_index[j].key);
+		if (((j - home) & OPERATION_INDEX_MASK) >= ((j - i) & OPERATION_INDEX_MASK)) {
+			connections_index[i] = connections_index[j];
+			i = j;
+		}
+	}
+
+	connections_index[i].conn = 0;
+}
+
+/* Must be called with operations_lock held */
+static void gb_operation_connection_deactivate(struct gb_operation_connection *conn)
+{
+	gb_operation_index_remove(gb_operation_connection_key(conn->intf_id, conn->cport));
+	conn->active = false;
+}
+
+/* Must be called with operations_lock held */
+static struct gb_operation_connection *gb_operation_connection_get(uint8_t intf_id,
+								   uint16_t cport, bool create)
+{
+	struct gb_operation_connection *conn, *free_conn = NULL, *idle_conn = NULL;
+	uint32_t key = gb_operation_connection_key(intf_id, cport);
+	size_t i;
+
+	conn = gb_operation_index_find(key);
+	if (conn || !create) {
+		return conn;
+	}
+
+	for (i = 0; i < MAX_OPERATION_CONNECTIONS && !free_conn; ++i) {
+		if (!connections[i].active) {
+			free_conn = &connections[i];
+		} else if (!connections[i].in_flight) {
+			idle_conn = idle_conn ? idle_conn : &connections[i];
+		}
+	}
+
+	/* Take over a connection without outstanding operations rather than failing */
+	free_conn = free_conn ? free_conn : idle_conn;
+	if (!free_conn) {
+		return NULL;
+	}
+
+	if (free_conn->active) {
+		gb_operation_connection_deactivate(free_conn);
+	}
+
+	free_conn->in_flight = 0;
+	free_conn->next_id = 1;
+	free_conn->cport = cport;
+	free_conn->intf_id = intf_id;
+	free_conn->active = true;
+	gb_operation_index_add(key, free_conn);
+
+	return free_conn;
+}
+
+/* Must be called with operations_lock held */
+static int gb_operation_id_alloc(struct gb_operation_connection *conn)
+{
+	uint32_t rotated, pos, free = ~conn->in_flight;
+	uint16_t id = conn->next_id;
+
+	if (!free) {
+		return -EBUSY;
+	}
+
+	do {
+		/* Operation id 0 is reserved for unidirectional operations */
+		if (id == 0) {
+			id = 1;
+		}
+
+		pos = id % OPERATION_WINDOW;
+		rotated = pos ? (free >> pos) | (free << (OPERATION_WINDOW - pos)) : free;
+		id += u32_count_trailing_zeros(rotated);
+	} while (id == 0);
+
+	conn->next_id = id + 1;
+
+	return id;
+}
+
+/* Must be called with operations_lock held */
+static void gb_operation_release(size_t slot)
+{
+	struct gb_operation_connection *conn = &connections[operations[slot].conn];
+
+	conn->in_flight &= ~BIT(operations[slot].op.operation_id % OPERATION_WINDOW);
+	operations_used &= ~BIT(slot);
+	if (!operations[slot].op.send) {
+		operations_observed--;
+	}
+}
+
+static void gb_operation_complete(struct gb_operation *op, const struct gb_message *resp,
+				  int status)
+{
+	if (op->callback) {
+		op->callback(op, resp, status);
+	}
+
+	if (op->request) {
+		gb_message_dealloc(op->request);
+	}
+}
+
+/* Must be called with operations_lock held */
+static void gb_operation_timeout_reschedule(void)
+{
+	int64_t deadline = INT64_MAX;
+	size_t i;
+
+	for (i = 0; i < MAX_GREYBUS_OPERATIONS; ++i) {
+		if (operations_used & BIT(i)) {
+			deadline = MIN(deadline, operations[i].op.deadline);
+		}
+	}
+
+	if (deadline != INT64_MAX) {
+		k_work_reschedule_for_queue(&gb_operation_workqueue, &gb_operation_timeout_work,
+					    K_MSEC(MAX(deadline - k_uptime_get(), 0)));
+	}
+}
+
+static void gb_operation_timeout_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	struct gb_operation op;
+	struct gb_message *msg;
+	k_spinlock_key_t key;
+	int64_t now = k_uptime_get();
+	uint32_t gen;
+	size_t i;
+
+	for (i = 0; i < MAX_GREYBUS_OPERATIONS; ++i) {
+		key = k_spin_lock(&operations_lock);
+
+		if (!(operations_used & BIT(i)) || operations[i].op.deadline > now) {
+			k_spin_unlock(&operations_lock, key);
+			continue;
+		}
+
+		if (operations[i].op.retries && operations[i].op.request) {
+			operations[i].op.retries--;
+			operations[i].op.deadline = now + operations[i].op.timeout_ms;
+			op = operations[i].op;
+			gen = operations[i].gen;
+			/* Borrow the request so that it is not copied under the lock */
+			operations[i].op.request = NULL;
+			k_spin_unlock(&operations_lock, key);
+
+			LOG_WRN("Operation %u of type %X timed out, retrying", op.operation_id,
+				op.type);
+			msg = gb_message_copy(op.request);
+
+			key = k_spin_lock(&operations_lock);
+			if ((operations_used & BIT(i)) && operations[i].gen == gen) {
+				operations[i].op.request = op.request;
+				op.request = NULL;
+			}
+			k_spin_unlock(&operations_lock, key);
+
+			/* The operation completed while its request was borrowed */
+			if (op.request) {
+				gb_message_dealloc(op.request);
+			}
+
+			if (msg) {
+				op.send(op.intf_id, op.cport, msg);
+			}
+			continue;
+		}
+
+		op = operations[i].op;
+		gb_operation_release(i);
+		k_spin_unlock(&operations_lock, key);
+
+		if (op.send) {
+			LOG_ERR("Operation %u of type %X timed out", op.operation_id, op.type);
+		} else {
+			LOG_DBG("Forwarded operation %u of type %X timed out", op.operation_id,
+				op.type);
+		}
+		gb_operation_complete(&op, NULL, -ETIMEDOUT);
+	}
+
+	key = k_spin_lock(&operations_lock);
+	gb_operation_timeout_reschedule();
+	k_spin_unlock(&operations_lock, key);
+}
+
+int gb_operation_send_request_via(gb_operation_send_t send, uint8_t intf_id, uint16_t cport,
+				  struct gb_message *msg, uint32_t timeout_ms, uint8_t retries,
+				  gb_operation_callback_t callback, void *user_data)
+{
+	struct gb_operation_connection *conn;
+	struct gb_operation *op;
+	struct gb_message *copy = NULL;
+	k_spinlock_key_t key;
+	uint32_t gen;
+	size_t slot;
+	int ret, operation_id;
+
+	if (retries) {
+		copy = gb_message_copy(msg);
+		if (!copy) {
+			LOG_WRN("Failed to keep request for retransmission");
+			retries = 0;
+		}
+	}
+
+	key = k_spin_lock(&operations_lock);
+
+	slot = u32_count_trailing_zeros(~operations_used);
+	if (slot >= MAX_GREYBUS_OPERATIONS) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	conn = gb_operation_connection_get(intf_id, cport, true);
+	if (!conn) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	operation_id = gb_operation_id_alloc(conn);
+	if (operation_id < 0) {
+		ret = operation_id;
+		goto unlock;
+	}
+
+	msg->header.operation_id = sys_cpu_to_le16(operation_id);
+	if (copy) {
+		copy->header.operation_id = msg->header.operation_id;
+	}
+
+	op = &operations[slot].op;
+	op->request = copy;
+	op->send = send;
+	op->callback = callback;
+	op->user_data = user_data;
+	op->start = k_cycle_get_32();
+	op->deadline = k_uptime_get() + timeout_ms;
+	op->latency_us = 0;
+	op->timeout_ms = timeout_ms;
+	op->operation_id = operation_id;
+	op->cport = cport;
+	op->intf_id = intf_id;
+	op->type = gb_message_type(msg);
+	op->retries = retries;
+	operations[slot].gen = ++operations_gen;
+	operations[slot].conn = conn - connections;
+
+	conn->slots[operation_id % OPERATION_WINDOW] = slot;
+	conn->in_flight |= BIT(operation_id % OPERATION_WINDOW);
+	operations_used |= BIT(slot);
+	gen = operations[slot].gen;
+	k_spin_unlock(&operations_lock, key);
+
+	ret = send(intf_id, cport, msg);
+
+	key = k_spin_lock(&operations_lock);
+	if (ret < 0) {
+		/*
+		 * A cancel or connection teardown may have completed the operation, and freed the
+		 * copy with it, while it was being sent. The slot may even be in use again.
+		 */
+		if ((operations_used & BIT(slot)) && operations[slot].gen == gen) {
+			gb_operation_release(slot);
+		} else {
+			copy = NULL;
+		}
+	} else {
+		gb_operation_timeout_reschedule();
+	}
+	k_spin_unlock(&operations_lock, key);
+
+	if (ret < 0) {
+		if (copy) {
+			gb_message_dealloc(copy);
+		}
+		return ret;
+	}
+
+	return operation_id;
+
+unlock:
+	k_spin_unlock(&operations_lock, key);
+	LOG_ERR("Too many outstanding operations on Interface %u, Cport %u", intf_id, cport);
+	if (copy) {
+		gb_message_dealloc(copy);
+	}
+	gb_message_dealloc(msg);
+	return ret;
+}
+
+int gb_operation_send_request(uint8_t intf_id, uint16_t cport, struct gb_message *msg,
+			      uint32_t timeout_ms, uint8_t retries,
+			      gb_operation_callback_t callback, void *user_data)
+{
+	return gb_operation_send_request_via(connection_send, intf_id, cport, msg, timeout_ms,
+					     retries, callback, user_data);
+}
+
+int gb_operation_observe_request(uint8_t intf_id, uint16_t cport,
+				 const struct gb_operation_msg_hdr *hdr, uint32_t timeout_ms,
+				 gb_operation_callback_t callback, void *user_data)
+{
+	uint16_t operation_id = sys_le16_to_cpu(hdr->operation_id);
+	uint8_t pos = operation_id % OPERATION_WINDOW;
+	struct gb_operation_connection *conn;
+	struct gb_operation *op;
+	k_spinlock_key_t key;
+	size_t slot;
+	int ret = 0;
+
+	/* Unidirectional operations have no response */
+	if (!operation_id) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&operations_lock);
+
+	slot = u32_count_trailing_zeros(~operations_used);
+	if (slot >= MAX_GREYBUS_OPERATIONS || operations_observed >= MAX_OBSERVED_OPERATIONS) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	conn = gb_operation_connection_get(intf_id, cport, true);
+	if (!conn) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	/* The id is chosen by the originator, it may clash with one in flight */
+	if (conn->in_flight & BIT(pos)) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	op = &operations[slot].op;
+	memset(op, 0, sizeof(*op));
+	op->callback = callback;
+	op->user_data = user_data;
+	op->start = k_cycle_get_32();
+	op->deadline = k_uptime_get() + timeout_ms;
+	op->timeout_ms = timeout_ms;
+	op->operation_id = operation_id;
+	op->cport = cport;
+	op->intf_id = intf_id;
+	op->type = hdr->type;
+	operations[slot].gen = ++operations_gen;
+	operations[slot].conn = conn - connections;
+
+	conn->slots[pos] = slot;
+	conn->in_flight |= BIT(pos);
+	operations_used |= BIT(slot);
+	operations_observed++;
+	gb_operation_timeout_reschedule();
+
+unlock:
+	k_spin_unlock(&operations_lock, key);
+	return ret;
+}
+
+/*
+ * Find the outstanding operation of a connection with the given id and request type. Must be
+ * called with operations_lock held.
+ *
+ * @param true to find a request tracked by gb_operation_observe_request()
+ *
+ * @return slot of the operation, negative if none
+ */
+static int gb_operation_find(uint8_t intf_id, uint16_t cport, uint16_t operation_id, uint8_t type,
+			     bool observed)
+{
+	struct gb_operation_connection *conn;
+	uint8_t pos = operation_id % OPERATION_WINDOW;
+	size_t slot;
+
+	conn = gb_operation_connection_get(intf_id, cport, false);
+	if (!conn || !(conn->in_flight & BIT(pos))) {
+		return -ENOENT;
+	}
+
+	slot = conn->slots[pos];
+	if (operations[slot].op.operation_id != operation_id || operations[slot].op.type != type ||
+	    (operations[slot].op.send == NULL) != observed) {
+		return -ENOENT;
+	}
+
+	return slot;
+}
+
+/*
+ * Complete the operation a response belongs to.
+ *
+ * @param interface
+ * @param cport
+ * @param greybus response. Ownership is not transferred.
+ * @param true to match requests tracked by gb_operation_observe_request() only, false to match
+ * the bridge's own requests only
+ *
+ * @return true if the response matched an outstanding operation
+ */
+static bool gb_operation_complete_response(uint8_t intf_id, uint16_t cport,
+					   const struct gb_message *msg, bool observed)
+{
+	struct gb_operation op;
+	k_spinlock_key_t key;
+	int slot;
+
+	key = k_spin_lock(&operations_lock);
+
+	slot = gb_operation_find(intf_id, cport, sys_le16_to_cpu(msg->header.operation_id),
+				 gb_message_type(msg) & ~GB_OP_RESPONSE, observed);
+	if (slot < 0) {
+		k_spin_unlock(&operations_lock, key);
+		return false;
+	}
+
+	op = operations[slot].op;
+	gb_operation_release(slot);
+	k_spin_unlock(&operations_lock, key);
+
+	op.latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - op.start);
+	LOG_DBG("Operation %u of type %X completed in %u us", op.operation_id, op.type,
+		op.latency_us);
+	gb_operation_complete(&op, msg, 0);
+
+	return true;
+}
+
+bool gb_operation_handle_response(uint8_t intf_id, uint16_t cport, const struct gb_message *msg)
+{
+	return gb_operation_complete_response(intf_id, cport, msg, false);
+}
+
+bool gb_operation_observe_response(uint8_t intf_id, uint16_t cport, const struct gb_message *msg)
+{
+	return gb_operation_complete_response(intf_id, cport, msg, true);
+}
+
+void gb_operation_handle_foreign_request(uint8_t intf_id, uint16_t cport,
+					 const struct gb_message *msg)
+{
+	struct gb_operation op;
+	k_spinlock_key_t key;
+	int slot;
+
+	key = k_spin_lock(&operations_lock);
+
+	slot = gb_operation_find(intf_id, cport, sys_le16_to_cpu(msg->header.operation_id),
+				 gb_message_type(msg), false);
+	if (slot < 0) {
+		k_spin_unlock(&operations_lock, key);
+		return;
+	}
+
+	op = operations[slot].op;
+	gb_operation_release(slot);
+	k_spin_unlock(&operations_lock, key);
+
+	LOG_DBG("Operation %u of type %X cancelled by a request of the same id", op.operation_id,
+		op.type);
+	gb_operation_complete(&op, NULL, -ECANCELED);
+}
+
+/*
+ * Cancel the outstanding operations of an interface and forget its connections.
+ *
+ * @param interface id
+ * @param cport
+ * @param true to cancel all cports of the interface
+ */
+static void gb_operation_cancel(uint8_t intf_id, uint16_t cport, bool all_cports)
+{
+	struct gb_operation op;
+	k_spinlock_key_t key;
+	size_t i;
+
+	for (i = 0; i < MAX_GREYBUS_OPERATIONS; ++i) {
+		key = k_spin_lock(&operations_lock);
+		if (!(operations_used & BIT(i)) || operations[i].op.intf_id != intf_id ||
+		    (!all_cports && operations[i].op.cport != cport)) {
+			k_spin_unlock(&operations_lock, key);
+			continue;
+		}
+
+		op = operations[i].op;
+		gb_operation_release(i);
+		k_spin_unlock(&operations_lock, key);
+
+		gb_operation_complete(&op, NULL, -ECANCELED);
+	}
+
+	key = k_spin_lock(&operations_lock);
+	for (i = 0; i < MAX_OPERATION_CONNECTIONS; ++i) {
+		if (connections[i].active && connections[i].intf_id == intf_id &&
+		    (all_cports || connections[i].cport == cport)) {
+			gb_operation_connection_deactivate(&connections[i]);
+		}
+	}
+	k_spin_unlock(&operations_lock, key);
+}
+
+void gb_operation_cancel_all(uint8_t intf_id)
+{
+	gb_operation_cancel(intf_id, 0, true);
+}
+
+void gb_operation_connection_destroy(uint8_t intf_id, uint16_t cport)
+{
+	gb_operation_cancel(intf_id, cport, false);
+}
+
+void gb_operation_init(void)
+{
+	const struct k_work_queue_config cfg = {
+		.name = "gb_operation_workqueue",
+		.no_yield = false,
+	};
+
+	k_work_queue_init(&gb_operation_workqueue);
+	k_work_queue_start(&gb_operation_workqueue, gb_operation_workqueue_stack,
+			   OPERATION_WORKQUEUE_STACK_SIZE, OPERATION_WORKQUEUE_PRIORITY, &cfg);
+}
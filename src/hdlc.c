@@ -219,3 +219,8 @@ int hdlc_rx_finish(uint32_t written)
 
 	return ret;
 }
+
+bool hdlc_rx_is_current(void)
+{
+	return k_current_get() == k_work_queue_thread_get(&hdlc_rx_workqueue);
+}
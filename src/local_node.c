@@ -7,30 +7,39 @@
 
 #include "greybus_messages.h"
 #include "greybus_interfaces.h"
+#include "greybus_operations.h"
 #include "greybus_protocols.h"
 #include "local_node.h"
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include "apbridge.h"
 
-#define CPORTS_NUM 1
+#define CPORTS_NUM 2
 
-#define CONTROL_PROTOCOL_CPORT 0
+#define CONTROL_PROTOCOL_CPORT  0
+#define LOOPBACK_PROTOCOL_CPORT 1
 
 LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
+/*
+ * Interface descriptor, two string descriptors, then bundle 1 (class loopback) with the loopback
+ * cport.
+ */
 static const uint8_t manifest[] = {
-	0x3c, 0x00, 0x00, 0x01, 0x08, 0x00, 0x01, 0x00, 0x01, 0x02, 0x00, 0x00, 0x18, 0x00, 0x02,
+	0x4c, 0x00, 0x00, 0x01, 0x08, 0x00, 0x01, 0x00, 0x01, 0x02, 0x00, 0x00, 0x18, 0x00, 0x02,
 	0x00, 0x11, 0x01, 0x42, 0x65, 0x61, 0x67, 0x6c, 0x65, 0x50, 0x6c, 0x61, 0x79, 0x20, 0x43,
 	0x43, 0x31, 0x33, 0x35, 0x32, 0x00, 0x18, 0x00, 0x02, 0x00, 0x11, 0x02, 0x42, 0x65, 0x61,
-	0x67, 0x6c, 0x65, 0x50, 0x6c, 0x61, 0x79, 0x20, 0x43, 0x43, 0x31, 0x33, 0x35, 0x32, 0x00};
+	0x67, 0x6c, 0x65, 0x50, 0x6c, 0x61, 0x79, 0x20, 0x43, 0x43, 0x31, 0x33, 0x35, 0x32, 0x00,
+	0x08, 0x00, 0x03, 0x00, 0x01, 0x11, 0x00, 0x00, 0x08, 0x00, 0x04, 0x00, 0x01, 0x00, 0x01,
+	0x11};
 
 static void response_helper(struct gb_interface *ctrl, struct gb_message *msg, const void *payload,
 			    size_t payload_len, uint8_t status, uint16_t cport_id)
 {
 	int ret;
+	uint16_t operation_id = sys_le16_to_cpu(msg->header.operation_id);
 	struct gb_message *resp = gb_message_response_alloc(payload, payload_len, msg->header.type,
-							    msg->header.operation_id, status);
+							    operation_id, status);
 
 	if (resp == NULL) {
 		LOG_ERR("Failed to allocate response for %X", msg->header.type);
@@ -45,7 +54,7 @@ static void response_helper(struct gb_interface *ctrl, struct gb_message *msg, c
 static void control_protocol_cport_shutdown_handler(struct gb_interface *ctrl,
 						    struct gb_message *msg)
 {
-	response_helper(ctrl, msg, NULL, 0, 0, CONTROL_PROTOCOL_CPORT);
+	response_helper(ctrl, msg, NULL, 0, GB_OP_SUCCESS, CONTROL_PROTOCOL_CPORT);
 }
 
 static void control_protocol_version_handler(struct gb_interface *ctrl, struct gb_message *msg)
@@ -55,7 +64,8 @@ static void control_protocol_version_handler(struct gb_interface *ctrl, struct g
 		.minor = 1,
 	};
 
-	response_helper(ctrl, msg, &response, sizeof(response), 0, CONTROL_PROTOCOL_CPORT);
+	response_helper(ctrl, msg, &response, sizeof(response), GB_OP_SUCCESS,
+			CONTROL_PROTOCOL_CPORT);
 }
 
 static void control_protocol_get_manifest_size_handler(struct gb_interface *ctrl,
@@ -65,17 +75,19 @@ static void control_protocol_get_manifest_size_handler(struct gb_interface *ctrl
 		.size = sys_cpu_to_le16(sizeof(manifest)),
 	};
 
-	response_helper(ctrl, msg, &response, sizeof(response), 0, CONTROL_PROTOCOL_CPORT);
+	response_helper(ctrl, msg, &response, sizeof(response), GB_OP_SUCCESS,
+			CONTROL_PROTOCOL_CPORT);
 }
 
 static void control_protocol_get_manifest_handler(struct gb_interface *ctrl, struct gb_message *msg)
 {
-	response_helper(ctrl, msg, manifest, sizeof(manifest), 0, CONTROL_PROTOCOL_CPORT);
+	response_helper(ctrl, msg, manifest, sizeof(manifest), GB_OP_SUCCESS,
+			CONTROL_PROTOCOL_CPORT);
 }
 
 static void control_protocol_empty_handler(struct gb_interface *ctrl, struct gb_message *msg)
 {
-	response_helper(ctrl, msg, NULL, 0, 0, CONTROL_PROTOCOL_CPORT);
+	response_helper(ctrl, msg, NULL, 0, GB_OP_SUCCESS, CONTROL_PROTOCOL_CPORT);
 }
 
 static void control_protocol_handle(struct gb_interface *ctrl, struct gb_message *msg)
@@ -108,17 +120,94 @@ static void control_protocol_handle(struct gb_interface *ctrl, struct gb_message
 	}
 }
 
+/*
+ * Turn a loopback request into its response in place and send it back. Saves a copy of the
+ * payload for TRANSFER, where request and response are identical.
+ *
+ * @param greybus request. The ownership is transferred.
+ * @param status of the response
+ */
+static void loopback_protocol_reply(struct gb_message *msg, uint8_t status)
+{
+	int ret;
+
+	msg->header.type = GB_RESPONSE(msg->header.type);
+	msg->header.result = status;
+
+	ret = connection_send(LOCAL_NODE_ID, LOOPBACK_PROTOCOL_CPORT, msg);
+	if (ret < 0) {
+		LOG_ERR("Failed to send loopback response");
+	}
+}
+
+static void loopback_protocol_transfer_handler(struct gb_interface *ctrl, struct gb_message *msg)
+{
+	const struct gb_loopback_transfer_request *req =
+		(const struct gb_loopback_transfer_request *)msg->payload;
+
+	if (gb_message_payload_len(msg) < sizeof(*req) ||
+	    gb_message_payload_len(msg) - sizeof(*req) != sys_le32_to_cpu(req->len)) {
+		LOG_ERR("Invalid loopback transfer request");
+		response_helper(ctrl, msg, NULL, 0, GB_OP_INVALID, LOOPBACK_PROTOCOL_CPORT);
+		gb_message_dealloc(msg);
+		return;
+	}
+
+	loopback_protocol_reply(msg, GB_OP_SUCCESS);
+}
+
+static void loopback_protocol_empty_handler(struct gb_interface *ctrl, struct gb_message *msg)
+{
+	response_helper(ctrl, msg, NULL, 0, GB_OP_SUCCESS, LOOPBACK_PROTOCOL_CPORT);
+	gb_message_dealloc(msg);
+}
+
+/*
+ * Handle a loopback protocol request.
+ *
+ * @param local node interface
+ * @param greybus request. The ownership is transferred.
+ */
+static void loopback_protocol_handle(struct gb_interface *ctrl, struct gb_message *msg)
+{
+	switch (gb_message_type(msg)) {
+	case GB_LOOPBACK_TYPE_TRANSFER:
+		loopback_protocol_transfer_handler(ctrl, msg);
+		break;
+	case GB_REQUEST_TYPE_CPORT_SHUTDOWN:
+	case GB_LOOPBACK_TYPE_PING:
+	case GB_LOOPBACK_TYPE_SINK:
+		loopback_protocol_empty_handler(ctrl, msg);
+		break;
+	default:
+		LOG_ERR("Unimplemented loopback protocol request %X", gb_message_type(msg));
+		gb_message_dealloc(msg);
+	}
+}
+
 static int intf_write(struct gb_interface *ctrl, struct gb_message *msg, uint16_t cport_id)
 {
-	LOG_DBG("Local node received %u of type %X on cport %u", msg->header.operation_id,
-		gb_message_type(msg), cport_id);
+	LOG_DBG("Local node received %u of type %X on cport %u",
+		sys_le16_to_cpu(msg->header.operation_id), gb_message_type(msg), cport_id);
+
+	if (gb_message_is_response(msg)) {
+		if (!gb_operation_handle_response(LOCAL_NODE_ID, cport_id, msg)) {
+			LOG_WRN("Unexpected response %u of type %X",
+				sys_le16_to_cpu(msg->header.operation_id), gb_message_type(msg));
+		}
+		goto free_msg;
+	}
 
 	switch (cport_id) {
 	case CONTROL_PROTOCOL_CPORT:
 		control_protocol_handle(ctrl, msg);
 		break;
+	case LOOPBACK_PROTOCOL_CPORT:
+		loopback_protocol_handle(ctrl, msg);
+		return 0;
 	}
 
+free_msg:
 	gb_message_dealloc(msg);
 
 	return 0;
@@ -126,7 +215,7 @@ static int intf_write(struct gb_interface *ctrl, struct gb_message *msg, uint16_
 
 static int intf_create_connection(struct gb_interface *ctrl, uint16_t cport_id)
 {
-	return 0;
+	return (cport_id < CPORTS_NUM) ? 0 : -EINVAL;
 }
 
 static void intf_destroy_connection(struct gb_interface *ctrl, uint16_t cport_id)
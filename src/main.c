@@ -5,6 +5,7 @@
 
 #include "ap.h"
 #include "apbridge.h"
+#include "greybus_operations.h"
 #include "greybus_protocols.h"
 #include "hdlc.h"
 #include "node.h"
@@ -17,8 +18,9 @@
 #include <zephyr/net/net_ip.h>
 
 #define UART_DEVICE_NODE  DT_CHOSEN(zephyr_shell_uart)
-#define CONTROL_SVC_START 0x01
-#define CONTROL_SVC_STOP  0x02
+#define CONTROL_SVC_START   0x01
+#define CONTROL_SVC_STOP    0x02
+#define CONTROL_APB_REQUEST 0x03
 
 LOG_MODULE_REGISTER(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
@@ -37,6 +39,34 @@ struct hdlc_greybus_frame {
 	uint8_t payload[];
 } __packed;
 
+/**
+ * struct control_apb_request - APBridge request received over the control channel
+ *
+ * @request: GB_APB_REQUEST_* or APBRIDGE_REQUEST_* type
+ * @cport: AP cport the request applies to
+ * @data: request payload
+ */
+struct control_apb_request {
+	uint8_t request;
+	uint16_t cport;
+	uint8_t data[];
+} __packed;
+
+/**
+ * struct control_apb_response - Response to an APBridge request sent over the control channel
+ *
+ * @command: CONTROL_APB_REQUEST
+ * @request: type of the request
+ * @status: 0 if successful, else positive errno
+ * @data: response payload
+ */
+struct control_apb_response {
+	uint8_t command;
+	uint8_t request;
+	uint8_t status;
+	uint8_t data[];
+} __packed;
+
 static int hdlc_send_callback(const uint8_t *buffer, size_t buffer_len)
 {
 	size_t i;
@@ -95,13 +125,15 @@ static int hdlc_process_greybus_frame(const char *buffer, size_t buffer_len)
 	}
 
 	msg = gb_message_alloc(gb_hdr_payload_len(hdr), gb_frame->hdr.type,
-			       gb_frame->hdr.operation_id, gb_frame->hdr.result);
+			       sys_le16_to_cpu(gb_frame->hdr.operation_id), gb_frame->hdr.result);
 	if (!msg) {
 		LOG_ERR("Failed to allocate greybus message");
 		return -1;
 	}
 
 	memcpy(msg->payload, gb_frame->payload, gb_message_payload_len(msg));
+	connection_latency_tag(AP_INF_ID, sys_le16_to_cpu(gb_frame->cport), msg,
+			       CONNECTION_LATENCY_UART_RX);
 	ret = ap_rx_submit(msg, sys_le16_to_cpu(gb_frame->cport));
 	if (ret < 0) {
 		LOG_ERR("Failed add message to AP Queue");
@@ -111,18 +143,52 @@ static int hdlc_process_greybus_frame(const char *buffer, size_t buffer_len)
 	return 0;
 }
 
+static int control_process_apb_request(const char *buffer, size_t buffer_len)
+{
+	const struct control_apb_request *req = (const struct control_apb_request *)buffer;
+	uint8_t resp_buffer[HDLC_MAX_BLOCK_SIZE];
+	struct control_apb_response *resp = (struct control_apb_response *)resp_buffer;
+	int ret;
+
+	if (buffer_len < sizeof(*req)) {
+		LOG_ERR("Invalid APBridge request");
+		return -1;
+	}
+
+	ret = apbridge_control_request(req->request, sys_le16_to_cpu(req->cport), req->data,
+				       buffer_len - sizeof(*req), resp->data,
+				       sizeof(resp_buffer) - sizeof(*resp));
+
+	resp->command = CONTROL_APB_REQUEST;
+	resp->request = req->request;
+	resp->status = (ret < 0) ? -ret : 0;
+
+	hdlc_block_send_sync(resp_buffer, sizeof(*resp) + MAX(ret, 0), ADDRESS_CONTROL, 0x03);
+
+	return ret;
+}
+
 static int control_process_frame(const char *buffer, size_t buffer_len)
 {
 	uint8_t command;
 	int ret;
 
-	if (buffer_len != 1) {
+	if (buffer_len < 1) {
 		LOG_ERR("Invalid Buffer");
 		return -1;
 	}
 
 	command = buffer[0];
 
+	if (command == CONTROL_APB_REQUEST) {
+		return control_process_apb_request(&buffer[1], buffer_len - 1);
+	}
+
+	if (buffer_len != 1) {
+		LOG_ERR("Invalid Buffer");
+		return -1;
+	}
+
 	switch (command) {
 	case CONTROL_SVC_START: {
 		LOG_INF("Starting SVC");
@@ -179,6 +245,8 @@ int main(void)
 	}
 
 	hdlc_init(hdlc_process_complete_frame, hdlc_send_callback);
+	gb_operation_init();
+	node_init();
 
 	ret = uart_irq_callback_user_data_set(uart_dev, serial_callback, NULL);
 	if (ret < 0) {
@@ -4,35 +4,305 @@
  */
 
 #include "node.h"
+#include "epoch.h"
 #include "greybus_protocols.h"
 #include "greybus_messages.h"
+#include "greybus_operations.h"
 #include "svc.h"
+#include "seqlock.h"
 #include <zephyr/net/net_ip.h>
 #include <zephyr/sys/dlist.h>
-#include <assert.h>
+#include <zephyr/sys/slist.h>
 #include <errno.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/net/socket.h>
+#include <zephyr/random/random.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
 #include "ap.h"
 
 #define MAX_GREYBUS_NODES         CONFIG_BEAGLEPLAY_GREYBUS_MAX_NODES
+/* The address index is kept at most half full so that probe sequences stay short */
+#define NODE_ADDR_INDEX_BITS      (LOG2CEIL(MAX_GREYBUS_NODES) + 1)
+#define NODE_ADDR_INDEX_SIZE      BIT(NODE_ADDR_INDEX_BITS)
+#define NODE_ADDR_INDEX_MASK      (NODE_ADDR_INDEX_SIZE - 1)
+#define NODE_RX_THREADS           CONFIG_BEAGLEPLAY_GREYBUS_NODE_RX_THREADS
 #define NODE_RX_THREAD_STACK_SIZE 2048
 #define NODE_RX_THREAD_PRIORITY   6
+#define NODE_RX_BUFFER_SIZE       256
+#define NODE_MAX_CPORT_SOCKETS    CONFIG_BEAGLEPLAY_GREYBUS_NODE_MAX_CPORT_SOCKETS
+#define NODE_RX_MAX_FDS           (MAX_GREYBUS_NODES * (NODE_MAX_CPORT_SOCKETS + 1) + 1)
+#define NODE_UDP_MAX_DATAGRAM     CONFIG_BEAGLEPLAY_GREYBUS_NODE_UDP_MAX_DATAGRAM
+#define NODE_TX_MAX_BATCH         4
+#define NODE_RX_EVENT_QUEUE_DEPTH 8
+
+#define NODE_CONNECT_TIMEOUT_MS     CONFIG_BEAGLEPLAY_GREYBUS_NODE_CONNECT_TIMEOUT_MS
+#define NODE_CONNECT_POLL_MS        20
+#define NODE_CONNECT_BACKOFF_MS     1000
+#define NODE_CONNECT_BACKOFF_MAX_MS CONFIG_BEAGLEPLAY_GREYBUS_NODE_CONNECT_BACKOFF_MAX_MS
+
+#define NODE_RESUME_GRACE_MS CONFIG_BEAGLEPLAY_GREYBUS_NODE_RESUME_GRACE_MS
+#define NODE_IDLE_CLOSE_MS   CONFIG_BEAGLEPLAY_GREYBUS_NODE_IDLE_CLOSE_MS
+
+#define NODE_HEARTBEAT_INTERVAL_MS CONFIG_BEAGLEPLAY_GREYBUS_NODE_HEARTBEAT_INTERVAL_MS
+#define NODE_HEARTBEAT_MISSES      CONFIG_BEAGLEPLAY_GREYBUS_NODE_HEARTBEAT_MISSES
+/* Completed before the next heartbeat is due */
+#define NODE_HEARTBEAT_TIMEOUT_MS  (NODE_HEARTBEAT_INTERVAL_MS / 2)
+
+#define NODE_TX_QUEUE_DEPTH          CONFIG_BEAGLEPLAY_GREYBUS_NODE_TX_QUEUE_DEPTH
+#define NODE_TX_POOL_SIZE            CONFIG_BEAGLEPLAY_GREYBUS_NODE_TX_POOL_SIZE
+#define NODE_TX_RETRIES              CONFIG_BEAGLEPLAY_GREYBUS_NODE_TX_RETRIES
+#define NODE_TX_BACKOFF_MS           10
+#define NODE_TX_WRITABLE_WAIT_MS     100
+#define NODE_TX_BATCH_BYTES          CONFIG_BEAGLEPLAY_GREYBUS_NODE_TX_BATCH_BYTES
+#define NODE_TX_BATCH_LINGER_US      CONFIG_BEAGLEPLAY_GREYBUS_NODE_TX_BATCH_LINGER_US
+#define NODE_TX_WORKQUEUE_STACK_SIZE 2048
+#define NODE_TX_WORKQUEUE_PRIORITY   6
+
+/* Interval at which removed nodes are checked for readers still using them */
+#define NODE_RECLAIM_POLL_MS 10
 
 LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
-struct gb_message_in_transport {
-	uint16_t cport_id;
+BUILD_ASSERT(MAX_GREYBUS_NODES < UINT8_MAX, "Node cache positions are indexed as uint8_t");
+
+/*
+ * Header of a greybus message on a node socket
+ *
+ * @param cport: cport of the node
+ * @param hdr: greybus header
+ */
+struct node_frame_hdr {
+	uint16_t cport;
+	struct gb_operation_msg_hdr hdr;
+} __packed;
+
+/*
+ * Receive state of a node socket. Messages are reassembled from whatever the socket delivers, so
+ * a partially received message never blocks the RX thread.
+ *
+ * @param hdr: header of the message being received
+ * @param hdr_len: bytes of hdr received so far
+ * @param hdr_start: bytes of hdr implied by the socket. Per cport sockets do not carry the cport.
+ * @param msg: message being received. NULL until hdr is complete.
+ * @param payload_len: bytes of the msg payload received so far
+ */
+struct node_rx_state {
+	struct node_frame_hdr hdr;
+	size_t hdr_len;
+	size_t hdr_start;
+	struct gb_message *msg;
+	size_t payload_len;
+};
+
+/*
+ * Message waiting in a node transmit queue
+ *
+ * @param snode: queue linkage
+ * @param msg: greybus message
+ * @param enqueued: uptime (ms) at which the message was queued
+ * @param cport: cport of the node
+ */
+struct node_tx_item {
+	sys_snode_t snode;
 	struct gb_message *msg;
+	uint32_t enqueued;
+	uint16_t cport;
+};
+
+/*
+ * Transmit state of a node. node_inf_write() only queues messages, they are sent from the node TX
+ * workqueue so that callers never wait for the radio. Sends do not block, so a node that is slow to
+ * drain its socket does not hold up the others.
+ *
+ * @param work: drains the queues. Delayed to back off after a transient failure.
+ * @param high_prio: messages on high priority cports, always sent first
+ * @param queue: other messages
+ * @param intf: node interface
+ * @param depth: number of queued messages
+ * @param queued_bytes: framed size of the messages in queue
+ * @param retries: failed attempts to send the message at the head
+ * @param blocked: the socket is full, sending resumes once the RX thread sees it writable
+ * @param partial: queue of a write the socket took in part, NULL if none. The write is completed
+ * before anything else is sent.
+ * @param partial_count: messages of the partial write
+ * @param partial_sent: bytes of the partial write sent so far
+ * @param dead: a send failed for good, the node is being removed
+ * @param stats: queue metrics. oldest_age_ms is computed when read.
+ */
+struct node_tx_state {
+	struct k_work_delayable work;
+	sys_slist_t high_prio;
+	sys_slist_t queue;
+	struct gb_interface *intf;
+	uint16_t depth;
+	uint32_t queued_bytes;
+	uint8_t retries;
+	bool blocked;
+	sys_slist_t *partial;
+	size_t partial_count;
+	size_t partial_sent;
+	bool dead;
+	struct node_tx_stats stats;
+};
+
+/*
+ * Socket of a single cport, used by nodes with NODE_TRANSPORT_TCP_CPORT
+ *
+ * @param sock: socket connected to GB_TRANSPORT_TCPIP_BASE_PORT + cport. -1 if unused.
+ * @param cport: cport of the node
+ * @param rx: receive state of the socket
+ * @param resume: reopen the socket when the node is resumed
+ */
+struct node_cport_sock {
+	int sock;
+	uint16_t cport;
+	struct node_rx_state rx;
+	bool resume;
+};
+
+/*
+ * Connection attempt made without blocking, see node_connect_handler()
+ *
+ * @param work: checks the attempt, on the node TX workqueue
+ * @param sock: socket being connected, -1 if none
+ * @param cport: cport of the node sock connects to
+ * @param deadline: uptime (ms) at which the attempt fails
+ */
+struct node_connect_state {
+	struct k_work_delayable work;
+	int sock;
+	uint16_t cport;
+	int64_t deadline;
+};
+
+/*
+ * Connection state of a node, see node_suspend()
+ */
+enum node_session {
+	NODE_SESSION_ACTIVE,
+	NODE_SESSION_SUSPENDED,
+	NODE_SESSION_RESUMING,
+	NODE_SESSION_EXPIRED,
+};
+
+/*
+ * Heartbeat state of a node, protected by node_heartbeat_lock. Heartbeats are control protocol
+ * version requests sent by the bridge on cport 0, tracked as operations of the node interface.
+ *
+ * @param pending: the last request has not completed yet
+ * @param misses: consecutive requests without response
+ * @param stats: heartbeat metrics
+ */
+struct node_heartbeat {
+	bool pending;
+	uint8_t misses;
+	struct node_heartbeat_stats stats;
 };
 
+/*
+ * @param sock: socket of cport 0, which carries all cports unless NODE_TRANSPORT_TCP_CPORT
+ * @param transport: how the cports of the node are mapped to sockets
+ * @param rx: receive state of sock
+ * @param cports: sockets of the other cports with NODE_TRANSPORT_TCP_CPORT
+ * @param tx: transmit state
+ * @param heartbeat: heartbeat state
+ * @param connect: reconnects a resuming node, connects a lazy node on first use
+ * @param session: connection state, protected by node_cache_lock
+ * @param grace_until: uptime (ms) at which a suspended node is removed
+ * @param last_active: uptime (ms) of the last message to or from the AP, see node_is_lazy()
+ * @param reclaim: linkage while waiting to be freed, see node_reclaim_handler()
+ */
 struct node_control_data {
 	int sock;
+	enum node_transport transport;
+	struct node_rx_state rx;
+	struct node_cport_sock cports[NODE_MAX_CPORT_SOCKETS];
+	struct node_tx_state tx;
+	struct node_heartbeat heartbeat;
+	struct node_connect_state connect;
+	enum node_session session;
+	int64_t grace_until;
+	atomic_t last_active;
+	sys_snode_t reclaim;
 };
 
 K_MEM_SLAB_DEFINE_STATIC(node_control_data_slab, sizeof(struct node_control_data),
 			 MAX_GREYBUS_NODES, 4);
 
+/*
+ * Owner of an entry of the RX poll set
+ *
+ * @param intf: node interface
+ * @param rx: receive state of the socket
+ * @param cport: cport carried by the socket, -1 if it carries all cports of the node
+ */
+struct node_rx_fd {
+	struct gb_interface *intf;
+	struct node_rx_state *rx;
+	int32_t cport;
+};
+
+enum node_rx_event_type {
+	NODE_RX_SOCK_ADD,
+	NODE_RX_SOCK_REMOVE,
+	NODE_RX_NODE_REMOVE,
+	NODE_RX_SOCK_WAIT_WRITABLE,
+};
+
+/*
+ * Change of the RX poll set, applied by the RX thread
+ *
+ * @param type: change
+ * @param sock: socket added or removed
+ * @param fd: owner of the socket. Only intf is used by NODE_RX_NODE_REMOVE and
+ * NODE_RX_SOCK_WAIT_WRITABLE.
+ */
+struct node_rx_event {
+	enum node_rx_event_type type;
+	int sock;
+	struct node_rx_fd fd;
+};
+
+/*
+ * RX thread serving a subset of the nodes. A node belongs to shard id % NODE_RX_THREADS, so all
+ * sockets of a node are served by the same thread. Messages of a node are thus forwarded one at a
+ * time and in the order they were received on each socket. There is no ordering between nodes.
+ *
+ * @param thread: RX thread
+ * @param pollfds: poll set, only used by the RX thread. Entry 0 is the wakeup pipe.
+ * @param fds: fds[i] owns pollfds[i]
+ * @param fds_len: entries in use
+ * @param pipe_writer: wakes the RX thread, -1 until the thread is running
+ * @param resync: set when an event could not be queued, the poll set is then rebuilt from the
+ * node cache
+ * @param event_queue: changes of the poll set
+ * @param event_queue_buf: storage of event_queue
+ * @param buf: receive buffer
+ * @param stats: receive counters
+ */
+struct node_rx_shard {
+	struct k_thread thread;
+	struct zsock_pollfd pollfds[NODE_RX_MAX_FDS];
+	struct node_rx_fd fds[NODE_RX_MAX_FDS];
+	size_t fds_len;
+	int pipe_writer;
+	atomic_t resync;
+	struct k_msgq event_queue;
+	char __aligned(4) event_queue_buf[NODE_RX_EVENT_QUEUE_DEPTH * sizeof(struct node_rx_event)];
+	uint8_t buf[MAX(NODE_RX_BUFFER_SIZE, NODE_UDP_MAX_DATAGRAM)];
+	struct node_rx_stats stats;
+};
+
+K_MEM_SLAB_DEFINE_STATIC(node_tx_item_slab, sizeof(struct node_tx_item), NODE_TX_POOL_SIZE, 4);
+
+/*
+ * @param sock: socket of cport 0
+ * @param id: interface id
+ * @param addr: address of the node
+ * @param inf: node interface
+ * @param fail_count: consecutive failed connections, carried over from node_backoff
+ */
 struct node_item {
 	int sock;
 	uint8_t id;
@@ -41,485 +311,2726 @@ struct node_item {
 	uint8_t fail_count;
 };
 
-/* Node Cache */
+/*
+ * Backoff of a node that failed to connect. Kept after the node is removed, so that discovery does
+ * not announce it again before retry_at.
+ *
+ * @param addr: address of the node
+ * @param retry_at: uptime (ms) from which the node may be announced again
+ * @param fail_count: consecutive failed connections. 0 if the entry is unused.
+ */
+struct node_backoff {
+	struct in6_addr addr;
+	int64_t retry_at;
+	uint8_t fail_count;
+};
+
+static struct node_backoff node_backoff[MAX_GREYBUS_NODES];
+static struct k_spinlock node_backoff_lock;
+
+/* Node Cache. Lookups on the message path are lock-free, see seqlock.h */
+static struct seqlock node_cache_lock;
 static struct node_item node_cache[MAX_GREYBUS_NODES];
 static size_t node_cache_pos;
 
+/*
+ * Indexes of the node cache, updated with it. Entries are the cache position + 1, 0 if empty.
+ * Interface ids index a table directly, addresses an open addressing hash with linear probing.
+ */
+static uint8_t node_cache_id_index[UINT8_MAX + 1];
+static uint8_t node_cache_addr_index[NODE_ADDR_INDEX_SIZE];
+
 static void node_rx_thread_entry(void *p1, void *p2, void *p3);
+static void node_remove_handler(struct k_work *work);
+static void node_heartbeat_handler(struct k_work *work);
+static void node_grace_handler(struct k_work *work);
+static void node_lost(struct gb_interface *intf);
+static void node_idle_handler(struct k_work *work);
+static void node_reclaim_handler(struct k_work *work);
 
-K_THREAD_DEFINE(node_rx_thread, NODE_RX_THREAD_STACK_SIZE, node_rx_thread_entry, NULL, NULL, NULL,
-		NODE_RX_THREAD_PRIORITY, 0, 0);
+K_THREAD_STACK_ARRAY_DEFINE(node_rx_thread_stacks, NODE_RX_THREADS, NODE_RX_THREAD_STACK_SIZE);
+static struct node_rx_shard node_rx_shards[NODE_RX_THREADS];
 
-static int local_pipe_writer;
+K_THREAD_STACK_DEFINE(node_tx_workqueue_stack, NODE_TX_WORKQUEUE_STACK_SIZE);
+static struct k_work_q node_tx_workqueue;
+static struct k_spinlock node_tx_lock;
 
-static void pipe_send()
+/* Nodes to remove outside of the context that found them dead, see node_remove_deferred() */
+K_MSGQ_DEFINE(node_remove_queue, sizeof(uint8_t), MAX_GREYBUS_NODES, 1);
+K_WORK_DEFINE(node_remove_work, node_remove_handler);
+
+K_WORK_DELAYABLE_DEFINE(node_heartbeat_work, node_heartbeat_handler);
+K_WORK_DELAYABLE_DEFINE(node_grace_work, node_grace_handler);
+K_WORK_DELAYABLE_DEFINE(node_idle_work, node_idle_handler);
+static struct k_spinlock node_heartbeat_lock;
+
+/*
+ * Removed nodes are freed once no reader can still use them, see node_read_lock(). Nodes wait in
+ * node_reclaim_pending, then in node_reclaim_draining while the epoch is flipped twice.
+ */
+static struct epoch node_epoch;
+static sys_slist_t node_reclaim_pending;
+static sys_slist_t node_reclaim_draining;
+static struct k_spinlock node_reclaim_lock;
+static uint8_t node_reclaim_flips;
+static int node_reclaim_epoch;
+K_WORK_DELAYABLE_DEFINE(node_reclaim_work, node_reclaim_handler);
+
+static struct node_rx_shard *node_rx_shard_of(uint8_t id)
 {
+	return &node_rx_shards[id % NODE_RX_THREADS];
+}
+
+/* Wake the RX thread serving a node */
+static void pipe_send(uint8_t id)
+{
+	const struct node_rx_shard *shard = node_rx_shard_of(id);
 	const uint8_t temp = 0;
-	int ret = zsock_send(local_pipe_writer, &temp, sizeof(temp), 0);
+	int ret;
+
+	/* The RX thread picks up the current poll set when it starts */
+	if (shard->pipe_writer < 0) {
+		return;
+	}
+
+	ret = zsock_send(shard->pipe_writer, &temp, sizeof(temp), 0);
 	if (ret < 0) {
 		LOG_ERR("Failed to write to pipe %d", errno);
 	}
 }
 
-static int node_cache_find_by_addr(const struct in6_addr *addr)
+/*
+ * Handle the loss of a node from the node TX workqueue, for callers that still use the interface.
+ *
+ * @param interface id of the node
+ */
+static void node_remove_deferred(uint8_t id)
+{
+	k_msgq_put(&node_remove_queue, &id, K_NO_WAIT);
+	k_work_submit_to_queue(&node_tx_workqueue, &node_remove_work);
+}
+
+/* Lazy nodes are connected on the first message and disconnected when idle */
+static bool node_is_lazy(const struct node_control_data *ctrl_data)
+{
+	return IS_ENABLED(CONFIG_BEAGLEPLAY_GREYBUS_NODE_LAZY_CONNECT) &&
+	       ctrl_data->transport != NODE_TRANSPORT_TCP_CPORT;
+}
+
+/* Cport carried by the socket of cport 0 */
+static int32_t node_rx_fd_cport(const struct node_control_data *ctrl_data)
+{
+	return ctrl_data->transport == NODE_TRANSPORT_TCP_CPORT ? 0 : -1;
+}
+
+/*
+ * Queue a change of the RX poll set. Must be called with node_cache_lock held, so that changes
+ * are applied in the order of the node cache updates. The caller wakes the RX thread of the node
+ * with pipe_send() once unlocked.
+ */
+static void node_rx_event_post(enum node_rx_event_type type, int sock, struct gb_interface *intf,
+			       struct node_rx_state *rx, int32_t cport)
+{
+	const struct node_rx_event event = {
+		.type = type,
+		.sock = sock,
+		.fd = {.intf = intf, .rx = rx, .cport = cport},
+	};
+
+	struct node_rx_shard *shard = node_rx_shard_of(intf->id);
+
+	if (k_msgq_put(&shard->event_queue, &event, K_NO_WAIT)) {
+		atomic_set(&shard->resync, 1);
+	}
+}
+
+static size_t node_addr_hash(const struct in6_addr *addr)
 {
+	uint32_t key = 0;
 	size_t i;
-	int ret;
 
-	for (i = 0; i < node_cache_pos; ++i) {
-		ret = net_ipv6_addr_cmp(&node_cache[i].addr, addr);
-		if (ret) {
-			return i;
+	for (i = 0; i < sizeof(addr->s6_addr); i += sizeof(uint32_t)) {
+		key ^= sys_get_le32(&addr->s6_addr[i]);
+	}
+
+	/* Fibonacci hashing */
+	return (key * 2654435761U) >> (32 - NODE_ADDR_INDEX_BITS);
+}
+
+/* Must be called with node_cache_lock held or inside a read section */
+static int node_cache_find_by_addr(const struct in6_addr *addr)
+{
+	size_t i = node_addr_hash(addr), probes;
+	uint8_t pos;
+
+	/* Bounded, the index can change under a reader */
+	for (probes = 0; probes < NODE_ADDR_INDEX_SIZE; ++probes) {
+		pos = node_cache_addr_index[i];
+		if (!pos) {
+			break;
 		}
+		if (net_ipv6_addr_cmp(&node_cache[pos - 1].addr, addr)) {
+			return pos - 1;
+		}
+		i = (i + 1) & NODE_ADDR_INDEX_MASK;
 	}
 
 	return -1;
 }
 
-static int node_cache_find_by_sock(int sock)
+/* Must be called with node_cache_lock held */
+static void node_cache_addr_index_add(size_t pos)
 {
-	size_t i;
+	size_t i = node_addr_hash(&node_cache[pos].addr);
 
-	for (i = 0; i < node_cache_pos; ++i) {
-		if (node_cache[i].sock == sock) {
-			return i;
+	while (node_cache_addr_index[i]) {
+		i = (i + 1) & NODE_ADDR_INDEX_MASK;
+	}
+
+	node_cache_addr_index[i] = pos + 1;
+}
+
+/* Must be called with node_cache_lock held. Returns the index slot of a cache position. */
+static size_t node_cache_addr_index_find(size_t pos)
+{
+	size_t i = node_addr_hash(&node_cache[pos].addr);
+
+	while (node_cache_addr_index[i] != pos + 1) {
+		i = (i + 1) & NODE_ADDR_INDEX_MASK;
+	}
+
+	return i;
+}
+
+/* Must be called with node_cache_lock held */
+static void node_cache_addr_index_remove(size_t pos)
+{
+	size_t i = node_cache_addr_index_find(pos), j, home;
+
+	/* Shift back later entries of the probe sequence instead of leaving a tombstone */
+	for (j = (i + 1) & NODE_ADDR_INDEX_MASK; node_cache_addr_index[j];
+	     j = (j + 1) & NODE_ADDR_INDEX_MASK) {
+		home = node_addr_hash(&node_cache[node_cache_addr_index[j] - 1].addr);
+		if (((j - home) & NODE_ADDR_INDEX_MASK) >= ((j - i) & NODE_ADDR_INDEX_MASK)) {
+			node_cache_addr_index[i] = node_cache_addr_index[j];
+			i = j;
 		}
 	}
 
-	return -1;
+	node_cache_addr_index[i] = 0;
 }
 
-static int node_cache_find_by_id(uint8_t id)
+/* Must be called with node_cache_lock held or inside a read section */
+static struct node_cport_sock *node_cport_sock_find(struct node_control_data *ctrl_data,
+						    uint16_t cport)
 {
 	size_t i;
 
-	for (i = 0; i < node_cache_pos; ++i) {
-		if (node_cache[i].id == id) {
-			return i;
+	for (i = 0; i < NODE_MAX_CPORT_SOCKETS; ++i) {
+		if (ctrl_data->cports[i].sock >= 0 && ctrl_data->cports[i].cport == cport) {
+			return &ctrl_data->cports[i];
 		}
 	}
 
-	return -1;
+	return NULL;
+}
+
+/* Must be called with node_cache_lock held or inside a read section */
+static int node_cache_find_by_id(uint8_t id)
+{
+	uint8_t pos = node_cache_id_index[id];
+
+	/* A reader may see a stale entry, checking the id makes the result consistent */
+	if (!pos || node_cache[pos - 1].id != id) {
+		return -1;
+	}
+
+	return pos - 1;
+}
+
+/*
+ * Copy the cache entry of a node.
+ *
+ * @param interface id of the node
+ * @param copy of the node entry
+ *
+ * @return true if found
+ */
+static bool node_cache_get_by_id(uint8_t id, struct node_item *node)
+{
+	atomic_val_t seq;
+	int ret;
+
+	do {
+		seq = seqlock_read_begin(&node_cache_lock);
+		ret = node_cache_find_by_id(id);
+		if (ret >= 0) {
+			*node = node_cache[ret];
+		}
+	} while (seqlock_read_retry(&node_cache_lock, seq));
+
+	return ret >= 0;
+}
+
+/*
+ * Copy the cache entry of a node.
+ *
+ * @param address of the node
+ * @param copy of the node entry
+ *
+ * @return true if found
+ */
+static bool node_cache_get_by_addr(const struct in6_addr *addr, struct node_item *node)
+{
+	atomic_val_t seq;
+	int ret;
+
+	do {
+		seq = seqlock_read_begin(&node_cache_lock);
+		ret = node_cache_find_by_addr(addr);
+		if (ret >= 0) {
+			*node = node_cache[ret];
+		}
+	} while (seqlock_read_retry(&node_cache_lock, seq));
+
+	return ret >= 0;
 }
 
 static int node_cache_add(int sock, uint8_t id, const struct in6_addr *addr,
-			  struct gb_interface *intf)
+			  struct gb_interface *intf, uint8_t fail_count)
 {
+	k_spinlock_key_t key;
+	int ret = 0;
+
+	key = seqlock_write_lock(&node_cache_lock);
+
 	if (node_cache_pos >= MAX_GREYBUS_NODES) {
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto unlock;
 	}
 
 	node_cache[node_cache_pos].sock = sock;
 	node_cache[node_cache_pos].id = id;
 	net_ipaddr_copy(&node_cache[node_cache_pos].addr, addr);
 	node_cache[node_cache_pos].inf = intf;
-	node_cache[node_cache_pos].fail_count = 0;
+	node_cache[node_cache_pos].fail_count = fail_count;
 
+	node_cache_id_index[id] = node_cache_pos + 1;
+	node_cache_addr_index_add(node_cache_pos);
 	node_cache_pos++;
 
+unlock:
+	seqlock_write_unlock(&node_cache_lock, key);
+	return ret;
+}
+
+/* Must be called with node_cache_lock held */
+static void node_cache_remove_at(size_t pos)
+{
+	node_cache_id_index[node_cache[pos].id] = 0;
+	node_cache_addr_index_remove(pos);
+
+	--node_cache_pos;
+	if (pos != node_cache_pos) {
+		/* The last entry moves into the hole */
+		node_cache_addr_index[node_cache_addr_index_find(node_cache_pos)] = pos + 1;
+		node_cache_id_index[node_cache[node_cache_pos].id] = pos + 1;
+		memcpy(&node_cache[pos], &node_cache[node_cache_pos], sizeof(struct node_item));
+	}
+}
+
+static int node_cache_remove(struct gb_interface *intf)
+{
+	k_spinlock_key_t key;
+	int ret;
+
+	key = seqlock_write_lock(&node_cache_lock);
+	ret = node_cache_find_by_id(intf->id);
+	if (ret >= 0 && node_cache[ret].inf == intf) {
+		node_cache_remove_at(ret);
+		node_rx_event_post(NODE_RX_NODE_REMOVE, -1, intf, NULL, -1);
+	} else {
+		ret = -ENOENT;
+	}
+	seqlock_write_unlock(&node_cache_lock, key);
+
+	if (ret >= 0) {
+		pipe_send(intf->id);
+	}
+
+	return ret;
+}
+
+/* Must be called with node_backoff_lock held */
+static struct node_backoff *node_backoff_find(const struct in6_addr *addr)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_GREYBUS_NODES; ++i) {
+		if (node_backoff[i].fail_count && net_ipv6_addr_cmp(&node_backoff[i].addr, addr)) {
+			return &node_backoff[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the backoff of a node that failed to connect.
+ *
+ * @param address of the node
+ * @param consecutive failed connections, at least 1
+ */
+static void node_backoff_set(const struct in6_addr *addr, uint8_t fail_count)
+{
+	struct node_backoff *entry;
+	k_spinlock_key_t key;
+	uint32_t delay;
+	size_t i;
+
+	/* Exponential, with equal jitter so that nodes failing together do not retry together */
+	delay = MIN((uint32_t)NODE_CONNECT_BACKOFF_MS << MIN(fail_count - 1, 16),
+		    NODE_CONNECT_BACKOFF_MAX_MS);
+	delay = delay / 2 + sys_rand32_get() % (delay / 2 + 1);
+
+	key = k_spin_lock(&node_backoff_lock);
+
+	/* Reuse the entry of the node, else a free one, else the one expiring first */
+	entry = node_backoff_find(addr);
+	for (i = 0; !entry && i < MAX_GREYBUS_NODES; ++i) {
+		if (!node_backoff[i].fail_count) {
+			entry = &node_backoff[i];
+		}
+	}
+	if (!entry) {
+		entry = &node_backoff[0];
+		for (i = 1; i < MAX_GREYBUS_NODES; ++i) {
+			if (node_backoff[i].retry_at < entry->retry_at) {
+				entry = &node_backoff[i];
+			}
+		}
+	}
+
+	net_ipaddr_copy(&entry->addr, addr);
+	entry->fail_count = fail_count;
+	entry->retry_at = k_uptime_get() + delay;
+
+	k_spin_unlock(&node_backoff_lock, key);
+
+	LOG_WRN("Node failed to connect %u times, retrying in %u ms", fail_count, delay);
+}
+
+/*
+ * Check if a node is backing off.
+ *
+ * @param address of the node
+ * @param consecutive failed connections of the node
+ *
+ * @return true if the node must not be announced yet
+ */
+static bool node_backoff_active(const struct in6_addr *addr, uint8_t *fail_count)
+{
+	struct node_backoff *entry;
+	k_spinlock_key_t key;
+	bool active;
+
+	key = k_spin_lock(&node_backoff_lock);
+	entry = node_backoff_find(addr);
+	*fail_count = entry ? entry->fail_count : 0;
+	active = entry && k_uptime_get() < entry->retry_at;
+	k_spin_unlock(&node_backoff_lock, key);
+
+	return active;
+}
+
+static void node_backoff_clear(const struct in6_addr *addr)
+{
+	struct node_backoff *entry;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&node_backoff_lock);
+	entry = node_backoff_find(addr);
+	if (entry) {
+		entry->fail_count = 0;
+	}
+	k_spin_unlock(&node_backoff_lock, key);
+}
+
+/*
+ * Count a failed connection to a node and remove the node. Discovery announces it again once its
+ * backoff expires.
+ *
+ * @param node interface
+ */
+static void node_connect_failed(struct gb_interface *intf)
+{
+	struct node_item node;
+	k_spinlock_key_t key;
+	int ret;
+
+	key = seqlock_write_lock(&node_cache_lock);
+	ret = node_cache_find_by_id(intf->id);
+	if (ret >= 0 && node_cache[ret].inf == intf) {
+		node_cache[ret].fail_count += node_cache[ret].fail_count < UINT8_MAX;
+		node = node_cache[ret];
+	} else {
+		ret = -ENODEV;
+	}
+	seqlock_write_unlock(&node_cache_lock, key);
+
+	if (ret < 0) {
+		return;
+	}
+
+	node_backoff_set(&node.addr, node.fail_count);
+
+	/* The caller still uses the interface */
+	node_remove_deferred(intf->id);
+}
+
+/*
+ * Publish the socket of a node once connected.
+ *
+ * @param node interface
+ * @param connected socket
+ *
+ * @return 0 if successful, -ENODEV if the node has been removed meanwhile
+ */
+static int node_cache_set_sock(struct gb_interface *intf, int sock)
+{
+	struct node_control_data *ctrl_data = intf->ctrl_data;
+	struct in6_addr addr;
+	k_spinlock_key_t key;
+	int ret;
+
+	key = seqlock_write_lock(&node_cache_lock);
+	ret = node_cache_find_by_id(intf->id);
+	if (ret >= 0 && node_cache[ret].inf == intf) {
+		node_cache[ret].sock = sock;
+		node_cache[ret].fail_count = 0;
+		net_ipaddr_copy(&addr, &node_cache[ret].addr);
+		ctrl_data->sock = sock;
+		ctrl_data->session = NODE_SESSION_ACTIVE;
+		node_rx_event_post(NODE_RX_SOCK_ADD, sock, intf, &ctrl_data->rx,
+				   node_rx_fd_cport(ctrl_data));
+		ret = 0;
+	} else {
+		ret = -ENODEV;
+	}
+	seqlock_write_unlock(&node_cache_lock, key);
+
+	if (!ret) {
+		node_backoff_clear(&addr);
+	}
+
+	return ret;
+}
+
+static struct gb_interface *node_cache_first(void)
+{
+	struct gb_interface *intf;
+	atomic_val_t seq;
+
+	do {
+		seq = seqlock_read_begin(&node_cache_lock);
+		intf = node_cache_pos ? node_cache[0].inf : NULL;
+	} while (seqlock_read_retry(&node_cache_lock, seq));
+
+	return intf;
+}
+
+/* Drop the first bytes of a gather list */
+static void iov_advance(struct iovec **iov, size_t *iovcnt, size_t len)
+{
+	while (*iovcnt && len >= (*iov)->iov_len) {
+		len -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+
+	if (*iovcnt) {
+		(*iov)->iov_base = (uint8_t *)(*iov)->iov_base + len;
+		(*iov)->iov_len -= len;
+	}
+}
+
+/*
+ * Send a gather list with as few syscalls as possible, without blocking. A write the socket takes
+ * in part is resumed by calling again with the same list. The iovec array is modified.
+ *
+ * @param socket
+ * @param gather list
+ * @param number of entries in the gather list
+ * @param bytes of the list sent by previous calls, updated
+ *
+ * @return 0 if the whole list was sent, -EAGAIN if the socket is full, negative errno in case of
+ * error
+ */
+static int write_iov(int sock, struct iovec *iov, size_t iovcnt, size_t *sent)
+{
+	struct msghdr hdr = {0};
+	ssize_t ret;
+
+	iov_advance(&iov, &iovcnt, *sent);
+
+	while (iovcnt) {
+		hdr.msg_iov = iov;
+		hdr.msg_iovlen = iovcnt;
+
+		ret = zsock_sendmsg(sock, &hdr, ZSOCK_MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return -EAGAIN;
+			}
+
+			LOG_ERR("Failed to transmit data %d", errno);
+			return -errno;
+		}
+		*sent += ret;
+
+		iov_advance(&iov, &iovcnt, ret);
+	}
+
+	return 0;
+}
+
+static bool node_rx_fd_is_high_prio(const struct node_rx_fd *fd)
+{
+	if (!atomic_get(&fd->intf->high_prio_cports)) {
+		return false;
+	}
+
+	/* A per cport socket carries a single cport */
+	return fd->cport < 0 || connection_node_is_high_prio(fd->intf->id, fd->cport);
+}
+
+/* Called by the RX thread of the node, inside a read section */
+static void node_rx_deliver(uint8_t id, uint16_t cport, struct gb_message *msg)
+{
+	struct node_control_data *ctrl_data;
+	struct node_item node;
+	int ret;
+
+	if (cport == 0 && gb_message_is_response(msg) && gb_operation_handle_response(id, 0, msg)) {
+		gb_message_dealloc(msg);
+		return;
+	}
+
+	/* Heartbeats do not keep a lazy node connected */
+	if (IS_ENABLED(CONFIG_BEAGLEPLAY_GREYBUS_NODE_LAZY_CONNECT) &&
+	    node_cache_get_by_id(id, &node)) {
+		ctrl_data = node.inf->ctrl_data;
+		atomic_set(&ctrl_data->last_active, k_uptime_get_32());
+	}
+
+	node_rx_shard_of(id)->stats.messages++;
+
+	connection_latency_tag(id, cport, msg, CONNECTION_LATENCY_NODE_RX);
+	ret = connection_send(id, cport, msg);
+	if (ret < 0) {
+		LOG_ERR("Failed to send message to AP");
+	}
+}
+
+/*
+ * Feed received bytes to the parser of a node socket and forward every completed message.
+ *
+ * @param interface id of the node the bytes were received from
+ * @param receive state of the node socket
+ * @param received bytes
+ * @param number of received bytes
+ *
+ * @return 0 if successful, negative in case of error
+ */
+static int node_rx_parse(uint8_t id, struct node_rx_state *rx, const uint8_t *data, size_t len)
+{
+	size_t chunk, payload_len;
+
+	while (len) {
+		if (!rx->msg) {
+			chunk = MIN(len, sizeof(rx->hdr) - rx->hdr_len);
+			memcpy((uint8_t *)&rx->hdr + rx->hdr_len, data, chunk);
+			rx->hdr_len += chunk;
+			data += chunk;
+			len -= chunk;
+
+			if (rx->hdr_len < sizeof(rx->hdr)) {
+				break;
+			}
+
+			if (sys_le16_to_cpu(rx->hdr.hdr.size) < sizeof(rx->hdr.hdr)) {
+				LOG_ERR("Invalid message size");
+				return -EINVAL;
+			}
+
+			rx->msg = gb_message_alloc(gb_hdr_payload_len(&rx->hdr.hdr),
+						   rx->hdr.hdr.type,
+						   sys_le16_to_cpu(rx->hdr.hdr.operation_id),
+						   rx->hdr.hdr.result);
+			if (!rx->msg) {
+				LOG_ERR("Failed to allocate node message");
+				return -ENOMEM;
+			}
+			rx->payload_len = 0;
+		}
+
+		payload_len = gb_message_payload_len(rx->msg);
+		chunk = MIN(len, payload_len - rx->payload_len);
+		memcpy(&rx->msg->payload[rx->payload_len], data, chunk);
+		rx->payload_len += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if (rx->payload_len < payload_len) {
+			break;
+		}
+
+		node_rx_deliver(id, sys_le16_to_cpu(rx->hdr.cport), rx->msg);
+		rx->msg = NULL;
+		rx->hdr_len = rx->hdr_start;
+	}
+
+	return 0;
+}
+
+static void node_rx_state_reset(struct node_rx_state *rx)
+{
+	if (rx->msg) {
+		gb_message_dealloc(rx->msg);
+	}
+
+	rx->msg = NULL;
+	rx->hdr_len = rx->hdr_start;
+	rx->payload_len = 0;
+}
+
+/*
+ * Prepare the receive state of a socket. Frees any partially received message.
+ *
+ * @param receive state
+ * @param true if the socket carries the cport in front of every message
+ * @param cport carried by the socket if not framed
+ */
+static void node_rx_state_init(struct node_rx_state *rx, bool framed, uint16_t cport)
+{
+	rx->hdr.cport = sys_cpu_to_le16(cport);
+	rx->hdr_start = framed ? 0 : sizeof(rx->hdr.cport);
+	node_rx_state_reset(rx);
+}
+
+/*
+ * Forward the messages of a datagram. Datagrams hold whole messages, so a truncated or malformed
+ * one is dropped without affecting the node.
+ *
+ * @param interface id of the node the datagram was received from
+ * @param receive state of the node socket
+ * @param datagram
+ * @param datagram length
+ */
+static void node_rx_datagram(uint8_t id, struct node_rx_state *rx, const uint8_t *data,
+			     size_t len)
+{
+	int ret;
+
+	ret = node_rx_parse(id, rx, data, len);
+	if (!ret && (rx->msg || rx->hdr_len != rx->hdr_start)) {
+		ret = -EMSGSIZE;
+	}
+
+	if (ret < 0) {
+		LOG_WRN("Dropped datagram from node %u %d", id, ret);
+	}
+
+	node_rx_state_reset(rx);
+}
+
+static void node_rx_handle(struct node_rx_shard *shard, struct zsock_pollfd *pfd,
+			   const struct node_rx_fd *fd)
+{
+	uint8_t *buf = shard->buf;
+	struct gb_interface *intf = fd->intf;
+	struct node_control_data *ctrl_data = intf->ctrl_data;
+	int ret;
+
+	/* Requested by the TX work of the node once the socket was full */
+	if (pfd->revents & ZSOCK_POLLOUT) {
+		pfd->events &= ~ZSOCK_POLLOUT;
+		k_work_reschedule_for_queue(&node_tx_workqueue, &ctrl_data->tx.work, K_NO_WAIT);
+	}
+
+	if (pfd->revents & ZSOCK_POLLNVAL) {
+		LOG_WRN("Socket invalid");
+		node_lost(intf);
+	} else if (pfd->revents & ZSOCK_POLLHUP) {
+		LOG_WRN("Socket pollhup");
+		node_lost(intf);
+	} else if (pfd->revents & ZSOCK_POLLERR) {
+		LOG_WRN("Socket error");
+		node_lost(intf);
+	} else if (pfd->revents & ZSOCK_POLLIN) {
+		/* Take everything available, the parser keeps partial messages across calls */
+		ret = zsock_recv(pfd->fd, buf, sizeof(shard->buf), ZSOCK_MSG_DONTWAIT);
+		if (ret > 0) {
+			shard->stats.bytes += ret;
+		}
+
+		if (ret >= 0 && ctrl_data->transport == NODE_TRANSPORT_UDP) {
+			node_rx_datagram(intf->id, fd->rx, buf, ret);
+			return;
+		}
+
+		if (ret == 0) {
+			LOG_ERR("Socket closed by peer");
+			node_lost(intf);
+			return;
+		}
+
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+
+			LOG_ERR("Failed to receive data %d", errno);
+			node_lost(intf);
+			return;
+		}
+
+		ret = node_rx_parse(intf->id, fd->rx, buf, ret);
+		if (ret < 0) {
+			LOG_ERR("Failed to parse node message");
+			node_lost(intf);
+		}
+	}
+}
+
+/* Adding a socket that is already in the poll set updates its owner */
+static void node_rx_fds_add(struct node_rx_shard *shard, int sock, const struct node_rx_fd *fd)
+{
+	size_t i;
+
+	for (i = 1; i < shard->fds_len; ++i) {
+		if (shard->pollfds[i].fd == sock) {
+			break;
+		}
+	}
+
+	if (i == NODE_RX_MAX_FDS) {
+		LOG_ERR("RX poll set full");
+		return;
+	}
+
+	shard->pollfds[i].fd = sock;
+	shard->pollfds[i].events = ZSOCK_POLLIN;
+	shard->pollfds[i].revents = 0;
+	shard->fds[i] = *fd;
+
+	if (i == shard->fds_len) {
+		shard->fds_len++;
+	}
+}
+
+static void node_rx_fds_remove_at(struct node_rx_shard *shard, size_t pos)
+{
+	--shard->fds_len;
+	if (pos != shard->fds_len) {
+		shard->pollfds[pos] = shard->pollfds[shard->fds_len];
+		shard->fds[pos] = shard->fds[shard->fds_len];
+	}
+}
+
+static void node_rx_fds_rebuild(struct node_rx_shard *shard)
+{
+	struct node_control_data *ctrl_data;
+	struct node_rx_fd fd;
+	atomic_val_t seq;
+	size_t i, j;
+
+	/* Events queued from now on are also in the cache, applying them again is harmless */
+	k_msgq_purge(&shard->event_queue);
+
+	do {
+		seq = seqlock_read_begin(&node_cache_lock);
+		shard->fds_len = 1;
+		for (i = 0; i < node_cache_pos; ++i) {
+			if (node_rx_shard_of(node_cache[i].id) != shard) {
+				continue;
+			}
+
+			ctrl_data = node_cache[i].inf->ctrl_data;
+			fd.intf = node_cache[i].inf;
+
+			if (node_cache[i].sock >= 0) {
+				fd.rx = &ctrl_data->rx;
+				fd.cport = node_rx_fd_cport(ctrl_data);
+				node_rx_fds_add(shard, node_cache[i].sock, &fd);
+			}
+
+			for (j = 0; j < NODE_MAX_CPORT_SOCKETS; ++j) {
+				if (ctrl_data->cports[j].sock >= 0) {
+					fd.rx = &ctrl_data->cports[j].rx;
+					fd.cport = ctrl_data->cports[j].cport;
+					node_rx_fds_add(shard, ctrl_data->cports[j].sock, &fd);
+				}
+			}
+		}
+	} while (seqlock_read_retry(&node_cache_lock, seq));
+}
+
+/*
+ * Apply the queued changes to the poll set of a shard. Entries may move.
+ *
+ * @return true if the poll set changed
+ */
+static bool node_rx_fds_update(struct node_rx_shard *shard)
+{
+	struct node_rx_event event;
+	bool changed = false;
+	size_t i;
+
+	if (atomic_clear(&shard->resync)) {
+		node_rx_fds_rebuild(shard);
+		return true;
+	}
+
+	while (!k_msgq_get(&shard->event_queue, &event, K_NO_WAIT)) {
+		changed = true;
+
+		switch (event.type) {
+		case NODE_RX_SOCK_ADD:
+			node_rx_fds_add(shard, event.sock, &event.fd);
+			break;
+		case NODE_RX_SOCK_REMOVE:
+			for (i = 1; i < shard->fds_len; ++i) {
+				if (shard->pollfds[i].fd == event.sock) {
+					node_rx_fds_remove_at(shard, i);
+					break;
+				}
+			}
+			break;
+		case NODE_RX_NODE_REMOVE:
+			for (i = shard->fds_len - 1; i > 0; --i) {
+				if (shard->fds[i].intf == event.fd.intf) {
+					node_rx_fds_remove_at(shard, i);
+				}
+			}
+			break;
+		case NODE_RX_SOCK_WAIT_WRITABLE:
+			for (i = 1; i < shard->fds_len; ++i) {
+				if (shard->pollfds[i].fd == event.sock) {
+					shard->pollfds[i].events |= ZSOCK_POLLOUT;
+					break;
+				}
+			}
+			break;
+		}
+	}
+
+	return changed;
+}
+
+static void node_rx_thread_entry(void *p1, void *p2, void *p3)
+{
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	struct node_rx_shard *shard = p1;
+	struct node_rx_fd fd;
+	size_t i, pass;
+	int pipe[2], ret, key;
+	uint8_t temp;
+
+	while (!svc_is_ready()) {
+		k_sleep(K_MSEC(500));
+	}
+
+	ret = zsock_socketpair(AF_UNIX, SOCK_STREAM, 0, pipe);
+	if (ret < 0) {
+		LOG_ERR("Failed to create socketpair %d", errno);
+		return;
+	}
+
+	shard->pollfds[0].fd = pipe[0];
+	shard->pollfds[0].events = ZSOCK_POLLIN;
+	shard->fds_len = 1;
+
+	/* Sockets connected before the pipe existed did not wake the thread */
+	atomic_set(&shard->resync, 1);
+	shard->pipe_writer = pipe[1];
+
+	while (1) {
+		/* Interfaces of the poll set are only used in a read section, not while polling */
+		key = node_read_lock();
+		node_rx_fds_update(shard);
+		node_read_unlock(key);
+
+		LOG_DBG("Polling for %zu sockets", shard->fds_len - 1);
+		ret = zsock_poll(shard->pollfds, shard->fds_len, -1);
+		if (ret < 0) {
+			LOG_ERR("Failed to poll");
+			continue;
+		}
+		shard->stats.wakeups++;
+
+		if (shard->pollfds[0].revents) {
+			/* Drain the pipe */
+			LOG_DBG("Wakeup by pipe");
+			zsock_recv(shard->pollfds[0].fd, &temp, sizeof(temp), 0);
+			ret--;
+		}
+
+		/* Sockets removed while polling must not be handled */
+		key = node_read_lock();
+		node_rx_fds_update(shard);
+
+		/* Serve nodes with high priority cports first */
+		for (pass = 0; pass < 2; ++pass) {
+			for (i = 1; i < shard->fds_len && ret > 0; ++i) {
+				if (!shard->pollfds[i].revents ||
+				    node_rx_fd_is_high_prio(&shard->fds[i]) != !pass) {
+					continue;
+				}
+
+				fd = shard->fds[i];
+				node_rx_handle(shard, &shard->pollfds[i], &fd);
+				shard->pollfds[i].revents = 0;
+				ret--;
+
+				/* Handling may remove nodes, which moves entries */
+				if (node_rx_fds_update(shard)) {
+					i = 0;
+				}
+			}
+		}
+		node_read_unlock(key);
+	}
+}
+
+/*
+ * Send a message without blocking. The module is removed by the caller on failure. Per cport
+ * sockets are not framed.
+ *
+ * @param socket
+ * @param message
+ * @param cport of the node
+ * @param true to prefix the message with the cport
+ * @param bytes sent by previous calls, see write_iov()
+ *
+ * @return 0 if successful, -EAGAIN if the socket is full, negative errno in case of error
+ */
+static int gb_message_send(int sock, const struct gb_message *msg, uint16_t cport, bool framed,
+			   size_t *sent)
+{
+	int ret;
+	uint16_t cport_le = sys_cpu_to_le16(cport);
+	size_t msg_len = sizeof(struct gb_operation_msg_hdr) + gb_message_payload_len(msg);
+	/* Header and payload are contiguous, so one TCP write carries the whole message */
+	struct iovec iov[] = {
+		{.iov_base = &cport_le, .iov_len = sizeof(cport_le)},
+		{.iov_base = (void *)&msg->header, .iov_len = msg_len},
+	};
+
+	ret = framed ? write_iov(sock, iov, ARRAY_SIZE(iov), sent)
+		     : write_iov(sock, &iov[1], 1, sent);
+	if (ret < 0 && ret != -EAGAIN) {
+		LOG_ERR("Failed to send Greybus Message to node");
+	}
+
+	return ret;
+}
+
+/*
+ * Send queued messages as a single datagram, or as a single write on a framed stream socket,
+ * without blocking
+ *
+ * @param socket
+ * @param messages to send
+ * @param number of messages, at most NODE_TX_MAX_BATCH
+ * @param true for a datagram socket
+ * @param bytes sent by previous calls on a stream socket, see write_iov()
+ *
+ * @return 0 if successful, -EAGAIN if the socket is full, negative errno in case of error
+ */
+static int gb_message_send_batch(int sock, struct node_tx_item *const *items, size_t count,
+				 bool datagram, size_t *sent)
+{
+	uint16_t cports[NODE_TX_MAX_BATCH];
+	struct iovec iov[NODE_TX_MAX_BATCH * 2];
+	struct msghdr hdr = {.msg_iov = iov, .msg_iovlen = count * 2};
+	size_t i;
+	int ret;
+
+	for (i = 0; i < count; ++i) {
+		cports[i] = sys_cpu_to_le16(items[i]->cport);
+		iov[i * 2].iov_base = &cports[i];
+		iov[i * 2].iov_len = sizeof(cports[i]);
+		iov[i * 2 + 1].iov_base = &items[i]->msg->header;
+		iov[i * 2 + 1].iov_len =
+			sizeof(struct gb_operation_msg_hdr) + gb_message_payload_len(items[i]->msg);
+	}
+
+	if (!datagram) {
+		ret = write_iov(sock, iov, count * 2, sent);
+		if (ret < 0 && ret != -EAGAIN) {
+			LOG_ERR("Failed to send %zu Greybus Messages to node", count);
+		}
+		return ret;
+	}
+
+	if (zsock_sendmsg(sock, &hdr, ZSOCK_MSG_DONTWAIT) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return -EAGAIN;
+		}
+
+		LOG_ERR("Failed to send datagram to node %d", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Start connecting to a node without blocking.
+ *
+ * @param address of the node
+ * @param SOCK_STREAM or SOCK_DGRAM
+ *
+ * @return socket with the connection in progress if successful, negative errno in case of error
+ */
+static int connect_start(const struct sockaddr *addr, int type)
+{
+	int ret, sock, flags;
+	int proto = (type == SOCK_DGRAM) ? IPPROTO_UDP : IPPROTO_TCP;
+	size_t addr_size;
+
+	/* Connecting a UDP socket only sets the peer, datagrams from others are filtered out */
+	if (addr->sa_family == AF_INET6) {
+		sock = zsock_socket(AF_INET6, type, proto);
+		addr_size = sizeof(struct sockaddr_in6);
+	} else {
+		sock = zsock_socket(AF_INET, type, proto);
+		addr_size = sizeof(struct sockaddr_in);
+	}
+
+	if (sock < 0) {
+		LOG_ERR("Failed to create socket %d", errno);
+		return -errno;
+	}
+
+	flags = zsock_fcntl(sock, F_GETFL, 0);
+	if (flags < 0 || zsock_fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+		ret = -errno;
+		goto fail;
+	}
+
+	ret = zsock_connect(sock, addr, addr_size);
+	if (ret < 0 && errno != EINPROGRESS) {
+		ret = -errno;
+		goto fail;
+	}
+
+	return sock;
+
+fail:
+	LOG_ERR("Failed to connect to node %d", ret);
+	zsock_close(sock);
+	return ret;
+}
+
+/*
+ * Wait for a connection started by connect_start(). The socket is blocking again once connected.
+ *
+ * @param socket
+ * @param time to wait in ms, 0 to only check
+ *
+ * @return 0 if connected, -EINPROGRESS if not yet, negative errno in case of error
+ */
+static int connect_finish(int sock, int timeout_ms)
+{
+	struct zsock_pollfd pfd = {.fd = sock, .events = ZSOCK_POLLOUT};
+	socklen_t optlen = sizeof(int);
+	int ret, flags, err = 0;
+
+	ret = zsock_poll(&pfd, 1, timeout_ms);
+	if (ret < 0) {
+		return -errno;
+	}
+
+	if (ret == 0) {
+		return -EINPROGRESS;
+	}
+
+	ret = zsock_getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &optlen);
+	if (ret < 0 || err) {
+		return ret < 0 ? -errno : -err;
+	}
+
+	flags = zsock_fcntl(sock, F_GETFL, 0);
+	if (flags < 0 || zsock_fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Address of the socket of a node cport
+ *
+ * @param node interface
+ * @param cport, added to GB_TRANSPORT_TCPIP_BASE_PORT
+ * @param address, set
+ *
+ * @return SOCK_STREAM or SOCK_DGRAM if successful, negative errno in case of error
+ */
+static int node_sockaddr(struct gb_interface *ctrl, uint16_t cport_id,
+			 struct sockaddr_in6 *node_addr)
+{
+	struct node_control_data *ctrl_data = ctrl->ctrl_data;
+	struct node_item node;
+
+	if (cport_id > UINT16_MAX - GB_TRANSPORT_TCPIP_BASE_PORT) {
+		return -EINVAL;
+	}
+
+	if (!node_cache_get_by_id(ctrl->id, &node)) {
+		LOG_ERR("Failed to find node %u in cache. This should not happen", ctrl->id);
+		return -EINVAL;
+	}
+
+	memcpy(&node_addr->sin6_addr, &node.addr, sizeof(struct in6_addr));
+	node_addr->sin6_family = AF_INET6;
+	node_addr->sin6_scope_id = 0;
+	node_addr->sin6_port = htons(GB_TRANSPORT_TCPIP_BASE_PORT + cport_id);
+
+	return (ctrl_data->transport == NODE_TRANSPORT_UDP) ? SOCK_DGRAM : SOCK_STREAM;
+}
+
+/*
+ * Start connecting to the socket of a node cport, see connect_start().
+ *
+ * @param node interface
+ * @param cport, added to GB_TRANSPORT_TCPIP_BASE_PORT
+ *
+ * @return socket with the connection in progress if successful, negative in case of error
+ */
+static int node_connect_start(struct gb_interface *ctrl, uint16_t cport_id)
+{
+	struct sockaddr_in6 node_addr;
+	int type;
+
+	type = node_sockaddr(ctrl, cport_id, &node_addr);
+	if (type < 0) {
+		return type;
+	}
+
+	return connect_start((struct sockaddr *)&node_addr, type);
+}
+
+/*
+ * Connect to the socket of a node cport, blocking for up to NODE_CONNECT_TIMEOUT_MS. Not used on
+ * the node TX workqueue, see node_connect_handler().
+ *
+ * @param node interface
+ * @param cport, added to GB_TRANSPORT_TCPIP_BASE_PORT
+ *
+ * @return connected socket if successful, negative in case of error
+ */
+static int node_connect(struct gb_interface *ctrl, uint16_t cport_id)
+{
+	int ret, sock;
+
+	sock = node_connect_start(ctrl, cport_id);
+	if (sock < 0) {
+		return sock;
+	}
+
+	ret = connect_finish(sock, NODE_CONNECT_TIMEOUT_MS);
+	if (ret < 0) {
+		ret = (ret == -EINPROGRESS) ? -ETIMEDOUT : ret;
+		LOG_ERR("Failed to connect to node %d", ret);
+		zsock_close(sock);
+		return ret;
+	}
+
+	return sock;
+}
+
+/*
+ * Publish the socket of a node cport once connected.
+ *
+ * @param node interface
+ * @param cport
+ * @param connected socket, closed in case of error
+ *
+ * @return socket if successful, negative errno in case of error
+ */
+static int node_cport_sock_add(struct gb_interface *ctrl, uint16_t cport_id, int sock)
+{
+	struct node_control_data *ctrl_data = ctrl->ctrl_data;
+	struct node_cport_sock *cport_sock;
+	k_spinlock_key_t key;
+	int ret;
+	size_t i;
+
+	key = seqlock_write_lock(&node_cache_lock);
+
+	/* The node might have been removed while connecting */
+	ret = node_cache_find_by_id(ctrl->id);
+	if (ret < 0 || node_cache[ret].inf != ctrl) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	if (node_cport_sock_find(ctrl_data, cport_id)) {
+		ret = -EALREADY;
+		goto unlock;
+	}
+
+	ret = -ENOMEM;
+	for (i = 0; i < NODE_MAX_CPORT_SOCKETS; ++i) {
+		cport_sock = &ctrl_data->cports[i];
+		if (cport_sock->sock < 0) {
+			cport_sock->cport = cport_id;
+			node_rx_state_init(&cport_sock->rx, false, cport_id);
+			cport_sock->sock = sock;
+			node_rx_event_post(NODE_RX_SOCK_ADD, sock, ctrl, &cport_sock->rx, cport_id);
+			ret = sock;
+			break;
+		}
+	}
+
+unlock:
+	seqlock_write_unlock(&node_cache_lock, key);
+
+	if (ret < 0) {
+		LOG_ERR("Failed to add socket of Cport %u of node %u: %d", cport_id, ctrl->id, ret);
+		zsock_close(sock);
+		return ret;
+	}
+
+	pipe_send(ctrl->id);
+
+	return sock;
+}
+
+static int node_cport_sock_open(struct gb_interface *ctrl, uint16_t cport_id)
+{
+	int sock;
+
+	sock = node_connect(ctrl, cport_id);
+	if (sock < 0) {
+		LOG_ERR("Failed to connect to Cport %u of node %u", cport_id, ctrl->id);
+		return sock;
+	}
+
+	return node_cport_sock_add(ctrl, cport_id, sock);
+}
+
+static void node_cport_sock_close(struct gb_interface *ctrl, uint16_t cport_id)
+{
+	struct node_control_data *ctrl_data = ctrl->ctrl_data;
+	struct node_cport_sock *cport_sock;
+	k_spinlock_key_t key;
+	int sock = -1;
+	size_t i;
+
+	key = seqlock_write_lock(&node_cache_lock);
+	cport_sock = node_cport_sock_find(ctrl_data, cport_id);
+	if (cport_sock) {
+		sock = cport_sock->sock;
+		cport_sock->sock = -1;
+		node_rx_event_post(NODE_RX_SOCK_REMOVE, sock, ctrl, NULL, -1);
+	}
+
+	/* Not to be reopened if the node is suspended */
+	for (i = 0; i < NODE_MAX_CPORT_SOCKETS; ++i) {
+		if (ctrl_data->cports[i].resume && ctrl_data->cports[i].cport == cport_id) {
+			ctrl_data->cports[i].resume = false;
+		}
+	}
+	seqlock_write_unlock(&node_cache_lock, key);
+
+	/* The receive state is reset when the slot is reused */
+	if (sock >= 0) {
+		zsock_close(sock);
+		pipe_send(ctrl->id);
+	}
+}
+
+static int node_intf_create_connection(struct gb_interface *ctrl, uint16_t cport_id)
+{
+	struct node_control_data *ctrl_data = ctrl->ctrl_data;
+	int ret, sock;
+
+	if (cport_id != 0) {
+		/* Multiplexed over the socket of cport 0 */
+		if (ctrl_data->transport != NODE_TRANSPORT_TCP_CPORT) {
+			return 0;
+		}
+
+		/* Sockets are reopened together when the node is resumed */
+		if (ctrl_data->session != NODE_SESSION_ACTIVE) {
+			return -ENOTCONN;
+		}
+
+		return node_cport_sock_open(ctrl, cport_id);
+	}
+
+	/* It is possible for cport 0 to be disconnected. Since we are not closing the tcp socket,
+	 * do not recreate an existing socket */
+	if (ctrl_data->sock >= 0) {
+		return ctrl_data->sock;
+	}
+
+	if (ctrl_data->session != NODE_SESSION_ACTIVE) {
+		return -ENOTCONN;
+	}
+
+	/* Connected by node_connect_handler() once the first message is queued */
+	if (node_is_lazy(ctrl_data)) {
+		return 0;
+	}
+
+	sock = node_connect(ctrl, 0);
+	if (sock < 0) {
+		LOG_ERR("Failed to connect to node %u", ctrl->id);
+		node_connect_failed(ctrl);
+		return sock;
+	}
+
+	/* The node might have been removed while connecting */
+	ret = node_cache_set_sock(ctrl, sock);
+	if (ret < 0) {
+		LOG_WRN("Node %u removed while connecting", ctrl->id);
+		zsock_close(sock);
+		return ret;
+	}
+
+	pipe_send(ctrl->id);
+
+	return sock;
+}
+
+static void node_intf_destroy_connection(struct gb_interface *ctrl, uint16_t cport_id)
+{
+	struct node_control_data *ctrl_data = ctrl->ctrl_data;
+
+	/* The socket of cport 0 is kept until the node is removed */
+	if (ctrl_data->transport == NODE_TRANSPORT_TCP_CPORT && cport_id != 0) {
+		node_cport_sock_close(ctrl, cport_id);
+	}
+}
+
+static void node_tx_item_free(struct node_tx_item *item)
+{
+	gb_message_dealloc(item->msg);
+	k_mem_slab_free(&node_tx_item_slab, (void **)&item);
+}
+
+/* A full socket is not an error, see node_tx_wait_writable() */
+static bool node_tx_error_is_transient(int err)
+{
+	return err == -ENOBUFS || err == -ENOMEM;
+}
+
+static void node_remove_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	struct gb_interface *intf;
+	uint8_t id;
+	int key;
+
+	while (!k_msgq_get(&node_remove_queue, &id, K_NO_WAIT)) {
+		key = node_read_lock();
+		intf = node_find_by_id(id);
+		if (intf) {
+			node_lost(intf);
+		}
+		node_read_unlock(key);
+	}
+}
+
+/*
+ * Peek the messages to send next. Must be called with node_tx_lock held.
+ *
+ * @param queue
+ * @param messages
+ * @param maximum number of messages
+ * @param maximum number of bytes, always exceeded by a single large message
+ *
+ * @return number of messages
+ */
+static size_t node_tx_peek(sys_slist_t *list, struct node_tx_item **items, size_t max,
+			   size_t max_len)
+{
+	struct node_tx_item *item;
+	size_t count = 0, len = 0, msg_len;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(list, item, snode) {
+		msg_len = sizeof(struct node_frame_hdr) + gb_message_payload_len(item->msg);
+		if (count == max || (count && len + msg_len > max_len)) {
+			break;
+		}
+
+		items[count++] = item;
+		len += msg_len;
+	}
+
+	return count;
+}
+
+/*
+ * Have the RX thread of a node reschedule its TX work once a full socket is writable again.
+ *
+ * @param node interface
+ * @param socket
+ */
+static void node_tx_wait_writable(struct gb_interface *intf, int sock)
+{
+	k_spinlock_key_t key;
+
+	key = seqlock_write_lock(&node_cache_lock);
+	node_rx_event_post(NODE_RX_SOCK_WAIT_WRITABLE, sock, intf, NULL, -1);
+	seqlock_write_unlock(&node_cache_lock, key);
+
+	pipe_send(intf->id);
+}
+
+/* Connection state of a node, which is protected by node_cache_lock */
+static enum node_session node_session_get(struct node_control_data *ctrl_data)
+{
+	enum node_session session;
+	atomic_val_t seq;
+
+	do {
+		seq = seqlock_read_begin(&node_cache_lock);
+		session = ctrl_data->session;
+	} while (seqlock_read_retry(&node_cache_lock, seq));
+
+	return session;
+}
+
+/*
+ * Check if the messages of a node are held, because it is suspended or connecting. They are sent
+ * once node_connect_handler() is done, or freed if the node is removed.
+ *
+ * @param control data of the node
+ *
+ * @return true if held
+ */
+static bool node_tx_is_held(struct node_control_data *ctrl_data)
+{
+	return node_session_get(ctrl_data) != NODE_SESSION_ACTIVE ||
+	       k_work_delayable_is_pending(&ctrl_data->connect.work);
+}
+
+static void node_tx_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct node_tx_state *tx = CONTAINER_OF(dwork, struct node_tx_state, work);
+	struct node_control_data *ctrl_data = CONTAINER_OF(tx, struct node_control_data, tx);
+	struct node_tx_item *items[NODE_TX_MAX_BATCH];
+	struct node_cport_sock *cport_sock;
+	struct node_tx_item *item;
+	sys_slist_t *list;
+	k_spinlock_key_t key;
+	uint8_t id = tx->intf->id;
+	bool udp = ctrl_data->transport == NODE_TRANSPORT_UDP;
+	bool framed = ctrl_data->transport != NODE_TRANSPORT_TCP_CPORT;
+	bool batch = udp || (IS_ENABLED(CONFIG_BEAGLEPLAY_GREYBUS_NODE_TX_BATCH) && framed);
+	size_t max_len = udp ? NODE_UDP_MAX_DATAGRAM : NODE_TX_BATCH_BYTES;
+	size_t i, count, sent;
+	int ret, sock;
+	atomic_val_t seq;
+
+	while (!tx->dead) {
+		/*
+		 * Messages queued together share a datagram, or a write when batching. The messages
+		 * of a partial write are still at the head of their queue.
+		 */
+		key = k_spin_lock(&node_tx_lock);
+		if (tx->partial) {
+			list = tx->partial;
+			count = node_tx_peek(list, items, tx->partial_count, max_len);
+			sent = tx->partial_sent;
+		} else {
+			list = sys_slist_is_empty(&tx->high_prio) ? &tx->queue : &tx->high_prio;
+			count = node_tx_peek(list, items, batch ? NODE_TX_MAX_BATCH : 1, max_len);
+			sent = 0;
+		}
+		tx->blocked = false;
+		k_spin_unlock(&node_tx_lock, key);
+
+		if (!count) {
+			return;
+		}
+		item = items[0];
+
+		if (node_tx_is_held(ctrl_data)) {
+			return;
+		}
+
+		/* Connected without blocking the workqueue, this work runs again once done */
+		sock = ctrl_data->sock;
+		if (sock < 0 && node_is_lazy(ctrl_data)) {
+			k_work_schedule_for_queue(&node_tx_workqueue, &ctrl_data->connect.work,
+						  K_NO_WAIT);
+			return;
+		}
+
+		if (!framed && item->cport != 0) {
+			do {
+				seq = seqlock_read_begin(&node_cache_lock);
+				cport_sock = node_cport_sock_find(ctrl_data, item->cport);
+				sock = cport_sock ? cport_sock->sock : -1;
+			} while (seqlock_read_retry(&node_cache_lock, seq));
+		}
+
+		if (sock < 0) {
+			ret = -ENOTCONN;
+		} else if (count > 1 || udp) {
+			ret = gb_message_send_batch(sock, items, count, udp, &sent);
+		} else {
+			ret = gb_message_send(sock, item->msg, item->cport, framed, &sent);
+		}
+
+		if (ret == -EAGAIN ||
+		    (ret < 0 && node_tx_error_is_transient(ret) && tx->retries < NODE_TX_RETRIES)) {
+			key = k_spin_lock(&node_tx_lock);
+			/* The rest of a partial write has to follow on the stream */
+			tx->partial = sent ? list : NULL;
+			tx->partial_count = count;
+			tx->partial_sent = sent;
+			if (ret == -EAGAIN) {
+				tx->blocked = true;
+			} else {
+				tx->retries++;
+				tx->stats.retries++;
+			}
+			k_spin_unlock(&node_tx_lock, key);
+
+			/* Other nodes are served meanwhile, the timeout covers a missed wakeup */
+			if (ret == -EAGAIN) {
+				node_tx_wait_writable(tx->intf, sock);
+				k_work_schedule_for_queue(&node_tx_workqueue, dwork,
+							  K_MSEC(NODE_TX_WRITABLE_WAIT_MS));
+				return;
+			}
+
+			LOG_WRN("Send to node %u failed %d, retry %u", id, ret, tx->retries);
+			k_work_schedule_for_queue(&node_tx_workqueue, dwork,
+						  K_MSEC(NODE_TX_BACKOFF_MS << (tx->retries - 1)));
+			return;
+		}
+
+		/* Suspended while sending, the messages wait for the node to come back */
+		if (ret < 0 && node_tx_is_held(ctrl_data)) {
+			return;
+		}
+
+		key = k_spin_lock(&node_tx_lock);
+		for (i = 0; i < count; ++i) {
+			sys_slist_get(list);
+			if (list == &tx->queue) {
+				tx->queued_bytes -= sizeof(struct node_frame_hdr) +
+						    gb_message_payload_len(items[i]->msg);
+			}
+		}
+		tx->depth -= count;
+		tx->retries = 0;
+		tx->partial = NULL;
+		if (ret < 0 && sock != ctrl_data->sock) {
+			/* Only the connection of this cport is affected */
+			tx->stats.drops++;
+		} else if (ret == 0) {
+			tx->stats.sent += count;
+			tx->stats.writes++;
+			tx->stats.max_age_ms =
+				MAX(tx->stats.max_age_ms, k_uptime_get_32() - item->enqueued);
+		}
+		k_spin_unlock(&node_tx_lock, key);
+
+		if (ret < 0 && sock != ctrl_data->sock) {
+			LOG_ERR("Failed to send to Cport %u of node %u %d", item->cport, id, ret);
+			node_tx_item_free(item);
+			continue;
+		}
+
+		if (ret < 0) {
+			LOG_ERR("Failed to send to node %u %d", id, ret);
+			for (i = 0; i < count; ++i) {
+				node_tx_item_free(items[i]);
+			}
+			tx->dead = true;
+			/* Removing the node frees this work, so it has to happen elsewhere */
+			node_remove_deferred(id);
+			return;
+		}
+
+		for (i = 0; i < count; ++i) {
+			connection_latency_tag(id, items[i]->cport, items[i]->msg,
+					       CONNECTION_LATENCY_NODE_TX);
+			node_tx_item_free(items[i]);
+		}
+	}
+}
+
+static void node_tx_state_init(struct node_tx_state *tx, struct gb_interface *intf)
+{
+	k_work_init_delayable(&tx->work, node_tx_work_handler);
+	sys_slist_init(&tx->high_prio);
+	sys_slist_init(&tx->queue);
+	tx->intf = intf;
+	tx->depth = 0;
+	tx->queued_bytes = 0;
+	tx->retries = 0;
+	tx->blocked = false;
+	tx->partial = NULL;
+	tx->dead = false;
+	memset(&tx->stats, 0, sizeof(tx->stats));
+}
+
+static void node_tx_state_flush(struct node_tx_state *tx)
+{
+	struct k_work_sync sync;
+	sys_snode_t *snode;
+	k_spinlock_key_t key;
+
+	k_work_cancel_delayable_sync(&tx->work, &sync);
+
+	key = k_spin_lock(&node_tx_lock);
+	while ((snode = sys_slist_get(&tx->high_prio)) || (snode = sys_slist_get(&tx->queue))) {
+		node_tx_item_free(CONTAINER_OF(snode, struct node_tx_item, snode));
+	}
+	tx->depth = 0;
+	tx->queued_bytes = 0;
+	tx->blocked = false;
+	tx->partial = NULL;
+	k_spin_unlock(&node_tx_lock, key);
+}
+
+/*
+ * Queue a message to a node.
+ *
+ * @param node interface
+ * @param message, always consumed
+ * @param cport of the node
+ *
+ * @return 0 if successful, negative errno in case of error
+ */
+static int node_tx_enqueue(struct gb_interface *ctrl, struct gb_message *msg, uint16_t cport_id)
+{
+	struct node_control_data *ctrl_data = ctrl->ctrl_data;
+	struct node_tx_state *tx = &ctrl_data->tx;
+	struct node_tx_item *item;
+	k_spinlock_key_t key;
+	bool high_prio, flush, backoff;
+	int ret;
+
+	ret = k_mem_slab_alloc(&node_tx_item_slab, (void **)&item, K_NO_WAIT);
+	if (ret) {
+		LOG_ERR("Out of TX items, dropping message to node %u", ctrl->id);
+		ret = -ENOMEM;
+		goto drop;
+	}
+
+	item->msg = msg;
+	item->cport = cport_id;
+	item->enqueued = k_uptime_get_32();
+	high_prio = atomic_get(&ctrl->high_prio_cports) &&
+		    connection_node_is_high_prio(ctrl->id, cport_id);
+
+	key = k_spin_lock(&node_tx_lock);
+	if (tx->dead) {
+		k_spin_unlock(&node_tx_lock, key);
+		k_mem_slab_free(&node_tx_item_slab, (void **)&item);
+		LOG_WRN("Node %u not connected, dropping message", ctrl->id);
+		ret = -ENOTCONN;
+		goto drop;
+	}
+
+	if (tx->depth >= NODE_TX_QUEUE_DEPTH) {
+		k_spin_unlock(&node_tx_lock, key);
+		k_mem_slab_free(&node_tx_item_slab, (void **)&item);
+		LOG_ERR("TX queue of node %u full, dropping message", ctrl->id);
+		ret = -ENOBUFS;
+		goto drop;
+	}
+
+	sys_slist_append(high_prio ? &tx->high_prio : &tx->queue, &item->snode);
+	if (!high_prio) {
+		tx->queued_bytes += sizeof(struct node_frame_hdr) + gb_message_payload_len(msg);
+	}
+	tx->depth++;
+	tx->stats.max_depth = MAX(tx->stats.max_depth, tx->depth);
+	/* With batching, small messages linger until enough bytes are queued to fill a write */
+	flush = !IS_ENABLED(CONFIG_BEAGLEPLAY_GREYBUS_NODE_TX_BATCH) || high_prio ||
+		ctrl_data->transport == NODE_TRANSPORT_TCP_CPORT ||
+		tx->queued_bytes >= NODE_TX_BATCH_BYTES;
+	backoff = tx->retries || tx->blocked;
+	k_spin_unlock(&node_tx_lock, key);
+
+	/* Neither lingering nor flushing moves a retry backoff or the wait for a full socket */
+	if (!flush) {
+		k_work_schedule_for_queue(&node_tx_workqueue, &tx->work,
+					  K_USEC(NODE_TX_BATCH_LINGER_US));
+	} else if (!backoff) {
+		k_work_reschedule_for_queue(&node_tx_workqueue, &tx->work, K_NO_WAIT);
+	} else {
+		k_work_schedule_for_queue(&node_tx_workqueue, &tx->work, K_NO_WAIT);
+	}
+
+	return 0;
+
+drop:
+	key = k_spin_lock(&node_tx_lock);
+	tx->stats.drops++;
+	k_spin_unlock(&node_tx_lock, key);
+	gb_message_dealloc(msg);
+	return ret;
+}
+
+static int node_inf_write(struct gb_interface *ctrl, struct gb_message *msg, uint16_t cport_id)
+{
+	struct node_control_data *ctrl_data = ctrl->ctrl_data;
+
+	atomic_set(&ctrl_data->last_active, k_uptime_get_32());
+
+	/* The AP picks its operation ids without knowing the ones of the heartbeats */
+	if (NODE_HEARTBEAT_INTERVAL_MS && cport_id == 0 && !gb_message_is_response(msg)) {
+		gb_operation_handle_foreign_request(ctrl->id, 0, msg);
+	}
+
+	return node_tx_enqueue(ctrl, msg, cport_id);
+}
+
+static void node_heartbeat_init(struct node_heartbeat *hb)
+{
+	memset(hb, 0, sizeof(*hb));
+}
+
+/* Heartbeats go straight to the node. They are not AP traffic, so not counted as activity. */
+static int node_heartbeat_write(uint8_t id, uint16_t cport, struct gb_message *msg)
+{
+	struct gb_interface *intf;
+	int key, ret;
+
+	key = node_read_lock();
+	intf = node_find_by_id(id);
+	if (intf) {
+		ret = node_tx_enqueue(intf, msg, cport);
+	} else {
+		gb_message_dealloc(msg);
+		ret = -ENODEV;
+	}
+	node_read_unlock(key);
+
+	return ret;
+}
+
+static void node_heartbeat_complete(const struct gb_operation *op, const struct gb_message *msg,
+				    int status)
+{
+	struct node_control_data *ctrl_data;
+	struct gb_interface *intf;
+	struct node_heartbeat *hb;
+	k_spinlock_key_t key;
+	uint32_t rtt = op->latency_us;
+	int read_key;
+
+	read_key = node_read_lock();
+
+	/* Completes from the operation workqueue may race with the removal of the node */
+	intf = node_find_by_id(POINTER_TO_UINT(op->user_data));
+	if (!intf) {
+		goto unlock;
+	}
+	ctrl_data = intf->ctrl_data;
+	hb = &ctrl_data->heartbeat;
+
+	key = k_spin_lock(&node_heartbeat_lock);
+	hb->pending = false;
+	if (!status) {
+		hb->misses = 0;
+		hb->stats.rtt_last_us = rtt;
+		hb->stats.rtt_max_us = MAX(hb->stats.rtt_max_us, rtt);
+		/* Moving average over about 8 heartbeats */
+		if (hb->stats.rtt_avg_us) {
+			hb->stats.rtt_avg_us += rtt / 8 - hb->stats.rtt_avg_us / 8;
+		} else {
+			hb->stats.rtt_avg_us = rtt;
+		}
+	} else if (status == -ETIMEDOUT) {
+		hb->misses++;
+		hb->stats.lost++;
+	}
+	k_spin_unlock(&node_heartbeat_lock, key);
+
+unlock:
+	node_read_unlock(read_key);
+}
+
+static void node_heartbeat_send(struct gb_interface *intf)
+{
+	const struct gb_control_version_request req = {.major = 0, .minor = 1};
+	struct node_control_data *ctrl_data = intf->ctrl_data;
+	struct node_heartbeat *hb = &ctrl_data->heartbeat;
+	struct gb_message *msg;
+	k_spinlock_key_t key;
+	uint8_t misses;
+	bool busy;
+	int ret;
+
+	key = k_spin_lock(&node_heartbeat_lock);
+	misses = hb->misses;
+	busy = hb->pending || misses >= NODE_HEARTBEAT_MISSES;
+	if (!busy) {
+		hb->pending = true;
+	}
+	k_spin_unlock(&node_heartbeat_lock, key);
+
+	if (misses >= NODE_HEARTBEAT_MISSES) {
+		LOG_ERR("Node %u missed %u heartbeats", intf->id, misses);
+		node_lost(intf);
+		return;
+	}
+
+	/* Only one heartbeat of a node is outstanding at a time */
+	if (busy) {
+		return;
+	}
+
+	/* The operation id comes from the window of the node cport 0, like any other request */
+	msg = gb_message_request_alloc(&req, sizeof(req), GB_CONTROL_TYPE_VERSION);
+	if (msg) {
+		ret = gb_operation_send_request_via(node_heartbeat_write, intf->id, 0, msg,
+						    NODE_HEARTBEAT_TIMEOUT_MS, 0,
+						    node_heartbeat_complete,
+						    UINT_TO_POINTER(intf->id));
+	} else {
+		ret = -ENOMEM;
+	}
+
+	key = k_spin_lock(&node_heartbeat_lock);
+	if (ret < 0) {
+		hb->pending = false;
+	} else {
+		hb->stats.sent++;
+	}
+	k_spin_unlock(&node_heartbeat_lock, key);
+
+	if (ret < 0) {
+		LOG_WRN("Failed to send heartbeat to node %u %d", intf->id, ret);
+	}
+}
+
+/* Runs on the node TX workqueue, so never alongside the TX work of a node it removes */
+static void node_heartbeat_handler(struct k_work *work)
+{
+	struct gb_interface *intfs[MAX_GREYBUS_NODES];
+	atomic_val_t seq;
+	size_t i, count;
+	int key;
+
+	key = node_read_lock();
+
+	/* Nodes are only pinged once the AP has connected their cport 0 */
+	do {
+		seq = seqlock_read_begin(&node_cache_lock);
+		count = 0;
+		for (i = 0; i < node_cache_pos; ++i) {
+			if (node_cache[i].sock >= 0) {
+				intfs[count++] = node_cache[i].inf;
+			}
+		}
+	} while (seqlock_read_retry(&node_cache_lock, seq));
+
+	for (i = 0; i < count; ++i) {
+		node_heartbeat_send(intfs[i]);
+	}
+
+	node_read_unlock(key);
+
+	k_work_schedule_for_queue(&node_tx_workqueue, k_work_delayable_from_work(work),
+				  K_MSEC(NODE_HEARTBEAT_INTERVAL_MS));
+}
+
+/*
+ * Keep a node that lost its connection for NODE_RESUME_GRACE_MS instead of removing it. The node
+ * keeps its interface id and the connections of the AP, so that node_resume() can bring it back
+ * without a new enumeration. Messages to the node are held meanwhile, up to NODE_TX_QUEUE_DEPTH.
+ *
+ * @param node interface
+ *
+ * @return 0 if suspended, -ENOTCONN if the node never connected, -ENODEV if it is gone or
+ * already suspended
+ */
+static int node_suspend(struct gb_interface *intf)
+{
+	struct node_control_data *ctrl_data = intf->ctrl_data;
+	int socks[NODE_MAX_CPORT_SOCKETS + 1];
+	k_spinlock_key_t key;
+	size_t i, count = 0;
+	int ret;
+
+	key = seqlock_write_lock(&node_cache_lock);
+	ret = node_cache_find_by_id(intf->id);
+	if (ret < 0 || node_cache[ret].inf != intf || ctrl_data->session != NODE_SESSION_ACTIVE) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	if (ctrl_data->sock < 0) {
+		ret = -ENOTCONN;
+		goto unlock;
+	}
+
+	socks[count++] = ctrl_data->sock;
+	ctrl_data->sock = -1;
+	node_cache[ret].sock = -1;
+	for (i = 0; i < NODE_MAX_CPORT_SOCKETS; ++i) {
+		if (ctrl_data->cports[i].sock >= 0) {
+			socks[count++] = ctrl_data->cports[i].sock;
+			ctrl_data->cports[i].sock = -1;
+			ctrl_data->cports[i].resume = true;
+		}
+	}
+	ctrl_data->session = NODE_SESSION_SUSPENDED;
+	ctrl_data->grace_until = k_uptime_get() + NODE_RESUME_GRACE_MS;
+	node_rx_event_post(NODE_RX_NODE_REMOVE, -1, intf, NULL, -1);
+	ret = 0;
+
+unlock:
+	seqlock_write_unlock(&node_cache_lock, key);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	pipe_send(intf->id);
+
+	/* Receive states are reset when resuming, the RX thread may still be using them */
+	for (i = 0; i < count; ++i) {
+		zsock_close(socks[i]);
+	}
+
+	/* A heartbeat in flight is not answered anymore */
+	gb_operation_connection_destroy(intf->id, 0);
+
+	LOG_WRN("Lost node %u, waiting %u ms for it to come back", intf->id, NODE_RESUME_GRACE_MS);
+	k_work_schedule_for_queue(&node_tx_workqueue, &node_grace_work,
+				  K_MSEC(NODE_RESUME_GRACE_MS));
+
+	return 0;
+}
+
+/*
+ * Handle a node whose connection failed. Connected nodes are suspended if a grace period is
+ * configured, others are reported removed.
+ *
+ * @param node interface
+ */
+static void node_lost(struct gb_interface *intf)
+{
+	if (!NODE_RESUME_GRACE_MS || node_suspend(intf) == -ENOTCONN) {
+		svc_send_module_removed(intf);
+	}
+}
+
+/*
+ * Start connecting the next socket of a node: cport 0, then the cport sockets a resuming node had.
+ *
+ * @param node interface
+ *
+ * @return 0 if a connection is in progress, -ENOENT if no socket is left, negative errno if cport
+ * 0 failed
+ */
+static int node_connect_next(struct gb_interface *intf)
+{
+	struct node_control_data *ctrl_data = intf->ctrl_data;
+	struct node_connect_state *conn = &ctrl_data->connect;
+	k_spinlock_key_t key;
+	int32_t cport;
+	size_t i;
+	int sock;
+
+	while (1) {
+		cport = -1;
+		if (ctrl_data->sock < 0) {
+			cport = 0;
+		} else {
+			key = seqlock_write_lock(&node_cache_lock);
+			for (i = 0; i < NODE_MAX_CPORT_SOCKETS; ++i) {
+				if (ctrl_data->cports[i].resume) {
+					ctrl_data->cports[i].resume = false;
+					cport = ctrl_data->cports[i].cport;
+					break;
+				}
+			}
+			seqlock_write_unlock(&node_cache_lock, key);
+		}
+
+		if (cport < 0) {
+			return -ENOENT;
+		}
+
+		sock = node_connect_start(intf, cport);
+		if (sock >= 0) {
+			conn->sock = sock;
+			conn->cport = cport;
+			conn->deadline = k_uptime_get() + NODE_CONNECT_TIMEOUT_MS;
+			return 0;
+		}
+
+		if (cport == 0) {
+			return sock;
+		}
+
+		LOG_ERR("Failed to connect to Cport %u of node %u", cport, intf->id);
+	}
+}
+
+/*
+ * Publish the socket of cport 0 of a resuming or lazy node. The messages held meanwhile are sent
+ * once all its sockets are connected.
+ *
+ * @param node interface
+ * @param connected socket, closed in case of error
+ *
+ * @return 0 if successful, -ENODEV if the node has been removed meanwhile
+ */
+static int node_connect_done(struct gb_interface *intf, int sock)
+{
+	struct node_control_data *ctrl_data = intf->ctrl_data;
+	bool resumed = node_session_get(ctrl_data) == NODE_SESSION_RESUMING;
+	k_spinlock_key_t key;
+	int ret;
+
+	/* Left over from the previous connection, the RX thread no longer uses it */
+	node_rx_state_init(&ctrl_data->rx, ctrl_data->transport != NODE_TRANSPORT_TCP_CPORT, 0);
+
+	key = k_spin_lock(&node_heartbeat_lock);
+	ctrl_data->heartbeat.misses = 0;
+	k_spin_unlock(&node_heartbeat_lock, key);
+
+	ret = node_cache_set_sock(intf, sock);
+	if (ret < 0) {
+		zsock_close(sock);
+		return ret;
+	}
+
+	/* A partial write went to the previous connection, the message is sent again in full */
+	key = k_spin_lock(&node_tx_lock);
+	ctrl_data->tx.dead = false;
+	ctrl_data->tx.retries = 0;
+	ctrl_data->tx.blocked = false;
+	ctrl_data->tx.partial = NULL;
+	k_spin_unlock(&node_tx_lock, key);
+
+	pipe_send(intf->id);
+
+	if (resumed) {
+		LOG_INF("Resumed node %u", intf->id);
+	} else {
+		LOG_DBG("Connected to node %u on first use", intf->id);
+	}
+
 	return 0;
 }
 
-static void node_cache_remove_at(size_t pos)
+/*
+ * Connect the sockets of a resuming node, or a lazy node on first use, one at a time without
+ * blocking the node TX workqueue it runs on. The TX work of the node holds its messages meanwhile.
+ */
+static void node_connect_handler(struct k_work *work)
 {
-	--node_cache_pos;
-	if (pos != node_cache_pos) {
-		memcpy(&node_cache[pos], &node_cache[node_cache_pos], sizeof(struct node_item));
-	}
-}
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct node_connect_state *conn = CONTAINER_OF(dwork, struct node_connect_state, work);
+	struct node_control_data *ctrl_data = CONTAINER_OF(conn, struct node_control_data, connect);
+	struct gb_interface *intf = ctrl_data->tx.intf;
+	k_spinlock_key_t key;
+	uint16_t cport;
+	int ret, sock;
 
-static int node_cache_remove_by_id(uint8_t id)
-{
-	int ret = node_cache_find_by_id(id);
-	if (ret >= 0) {
-		node_cache_remove_at(ret);
-	}
+	while (1) {
+		if (conn->sock < 0) {
+			ret = node_connect_next(intf);
+			if (ret == -ENOENT) {
+				break;
+			}
 
-	return ret;
-}
+			if (ret < 0) {
+				goto fail;
+			}
+		}
 
-static int write_data(int sock, const void *data, size_t len)
-{
-	int ret, transmitted = 0;
+		ret = connect_finish(conn->sock, 0);
+		if (ret == -EINPROGRESS && k_uptime_get() < conn->deadline) {
+			k_work_schedule_for_queue(&node_tx_workqueue, dwork,
+						  K_MSEC(NODE_CONNECT_POLL_MS));
+			return;
+		}
+
+		sock = conn->sock;
+		cport = conn->cport;
+		conn->sock = -1;
 
-	while (transmitted < len) {
-		ret = zsock_send(sock, transmitted + (char *)data, len - transmitted, 0);
 		if (ret < 0) {
-			LOG_ERR("Failed to transmit data");
-			return ret;
+			zsock_close(sock);
+			if (cport == 0) {
+				goto fail;
+			}
+
+			LOG_ERR("Failed to reopen Cport %u of node %u %d", cport, intf->id, ret);
+			continue;
+		}
+
+		if (cport) {
+			node_cport_sock_add(intf, cport, sock);
+		} else if (node_connect_done(intf, sock) < 0) {
+			return;
 		}
-		transmitted += ret;
 	}
-	return transmitted;
+
+	k_work_reschedule_for_queue(&node_tx_workqueue, &ctrl_data->tx.work, K_NO_WAIT);
+	return;
+
+fail:
+	if (node_session_get(ctrl_data) != NODE_SESSION_RESUMING) {
+		LOG_ERR("Failed to connect to node %u", intf->id);
+		node_connect_failed(intf);
+
+		/* Messages are freed when the node is removed */
+		key = k_spin_lock(&node_tx_lock);
+		ctrl_data->tx.dead = true;
+		k_spin_unlock(&node_tx_lock, key);
+		return;
+	}
+
+	LOG_WRN("Failed to resume node %u", intf->id);
+	key = seqlock_write_lock(&node_cache_lock);
+	ctrl_data->session = NODE_SESSION_SUSPENDED;
+	seqlock_write_unlock(&node_cache_lock, key);
+
+	/* The grace period may have ended while connecting */
+	k_work_schedule_for_queue(&node_tx_workqueue, &node_grace_work, K_NO_WAIT);
 }
 
-static int read_data(int sock, void *data, size_t len)
+/* Abort the connection attempt of a node. Not to be called from node_connect_handler(). */
+static void node_connect_cancel(struct node_control_data *ctrl_data)
 {
-	int ret, received = 0;
+	struct k_work_sync sync;
 
-	while (received < len) {
-		ret = zsock_recv(sock, received + (char *)data, len - received, 0);
-		if (ret <= 0) {
-			LOG_ERR("Failed to receive data");
-			return ret;
-		}
-		received += ret;
+	k_work_cancel_delayable_sync(&ctrl_data->connect.work, &sync);
+
+	if (ctrl_data->connect.sock >= 0) {
+		zsock_close(ctrl_data->connect.sock);
+		ctrl_data->connect.sock = -1;
 	}
-	return received;
 }
 
-static struct gb_message_in_transport gb_message_receive(int sock, bool *flag)
+/*
+ * Reconnect a suspended node and reopen the sockets it had. The AP does not notice. Only starts
+ * node_connect_handler(), so discovery does not wait for the node.
+ *
+ * @param node interface
+ */
+static void node_resume(struct gb_interface *intf)
 {
+	struct node_control_data *ctrl_data = intf->ctrl_data;
+	k_spinlock_key_t key;
 	int ret;
-	struct gb_operation_msg_hdr hdr;
-	struct gb_message_in_transport msg;
 
-	ret = read_data(sock, &msg.cport_id, sizeof(uint16_t));
-	if (ret != sizeof(uint16_t)) {
-		*flag = ret == 0;
-		goto early_exit;
+	/* Resuming nodes are not expired, see node_grace_handler() */
+	key = seqlock_write_lock(&node_cache_lock);
+	ret = node_cache_find_by_id(intf->id);
+	if (ret >= 0 && node_cache[ret].inf == intf &&
+	    ctrl_data->session == NODE_SESSION_SUSPENDED) {
+		ctrl_data->session = NODE_SESSION_RESUMING;
+		ret = 0;
+	} else {
+		ret = -ENODEV;
 	}
-	msg.cport_id = sys_le16_to_cpu(msg.cport_id);
+	seqlock_write_unlock(&node_cache_lock, key);
 
-	ret = read_data(sock, &hdr, sizeof(hdr));
-	if (ret != sizeof(hdr)) {
-		*flag = ret == 0;
-		goto early_exit;
+	if (!ret) {
+		k_work_schedule_for_queue(&node_tx_workqueue, &ctrl_data->connect.work, K_NO_WAIT);
 	}
+}
 
-	msg.msg =
-		gb_message_alloc(gb_hdr_payload_len(&hdr), hdr.type, hdr.operation_id, hdr.result);
-	if (!msg.msg) {
-		LOG_ERR("Failed to allocate node message");
-		goto early_exit;
+/*
+ * Close the connection of a lazy node, which is connected again on the next message. Runs on the
+ * node TX workqueue, so the TX work of the node cannot be using the socket.
+ *
+ * @param node interface
+ */
+static void node_idle_close(struct gb_interface *intf)
+{
+	struct node_control_data *ctrl_data = intf->ctrl_data;
+	k_spinlock_key_t key;
+	int ret, sock = -1;
+
+	key = seqlock_write_lock(&node_cache_lock);
+	ret = node_cache_find_by_id(intf->id);
+	if (ret >= 0 && node_cache[ret].inf == intf && ctrl_data->session == NODE_SESSION_ACTIVE) {
+		sock = ctrl_data->sock;
+		ctrl_data->sock = -1;
+		node_cache[ret].sock = -1;
+		node_rx_event_post(NODE_RX_NODE_REMOVE, -1, intf, NULL, -1);
 	}
+	seqlock_write_unlock(&node_cache_lock, key);
 
-	ret = read_data(sock, msg.msg->payload, gb_message_payload_len(msg.msg));
-	if (ret != gb_message_payload_len(msg.msg)) {
-		*flag = ret == 0;
-		goto free_msg;
+	if (sock < 0) {
+		return;
 	}
 
-	return msg;
+	pipe_send(intf->id);
+	zsock_close(sock);
 
-free_msg:
-	gb_message_dealloc(msg.msg);
-early_exit:
-	msg.cport_id = 0;
-	msg.msg = NULL;
-	return msg;
+	/* A heartbeat in flight is not answered anymore */
+	gb_operation_connection_destroy(intf->id, 0);
+	key = k_spin_lock(&node_heartbeat_lock);
+	ctrl_data->heartbeat.misses = 0;
+	k_spin_unlock(&node_heartbeat_lock, key);
+
+	LOG_DBG("Closed idle connection to node %u", intf->id);
 }
 
-static void svc_send_module_removed_by_sock(int sock)
+static void node_idle_handler(struct k_work *work)
 {
-	int ret = node_cache_find_by_sock(sock);
-	if (ret < 0) {
-		LOG_ERR("Failed to find node");
-		return;
-	}
+	struct gb_interface *intfs[MAX_GREYBUS_NODES];
+	struct node_control_data *ctrl_data;
+	uint32_t now = k_uptime_get_32();
+	k_spinlock_key_t key;
+	atomic_val_t seq;
+	size_t i, count;
+	int read_key;
+	bool idle;
+
+	read_key = node_read_lock();
+
+	do {
+		seq = seqlock_read_begin(&node_cache_lock);
+		count = 0;
+		for (i = 0; i < node_cache_pos; ++i) {
+			ctrl_data = node_cache[i].inf->ctrl_data;
+			if (node_cache[i].sock >= 0 && node_is_lazy(ctrl_data)) {
+				intfs[count++] = node_cache[i].inf;
+			}
+		}
+	} while (seqlock_read_retry(&node_cache_lock, seq));
 
-	svc_send_module_removed(node_cache[ret].inf);
-}
+	for (i = 0; i < count; ++i) {
+		ctrl_data = intfs[i]->ctrl_data;
 
-static void node_rx_thread_entry(void *p1, void *p2, void *p3)
-{
-	struct zsock_pollfd fds[AP_MAX_NODES + 1];
-	size_t i, fds_len = 1;
-	int pipe[2], ret;
-	uint8_t temp;
-	bool flag = false;
-	struct gb_message_in_transport msg;
+		key = k_spin_lock(&node_tx_lock);
+		idle = !ctrl_data->tx.depth &&
+		       now - (uint32_t)atomic_get(&ctrl_data->last_active) >= NODE_IDLE_CLOSE_MS;
+		k_spin_unlock(&node_tx_lock, key);
 
-	while (!svc_is_ready()) {
-		k_sleep(K_MSEC(500));
+		if (idle) {
+			node_idle_close(intfs[i]);
+		}
 	}
 
-	ret = zsock_socketpair(AF_UNIX, SOCK_STREAM, 0, pipe);
-	if (ret < 0) {
-		LOG_ERR("Failed to create socketpair %d", errno);
-		return;
-	}
+	node_read_unlock(read_key);
 
-	local_pipe_writer = pipe[1];
-	fds[0].fd = pipe[0];
+	k_work_schedule_for_queue(&node_tx_workqueue, k_work_delayable_from_work(work),
+				  K_MSEC(NODE_IDLE_CLOSE_MS / 2));
+}
 
-	while (1) {
-		/* Populate fds */
-		fds[0].events = ZSOCK_POLLIN;
-		for (i = 0; i < node_cache_pos; ++i) {
-			fds[i + 1].fd = node_cache[i].sock;
-			fds[i + 1].events = ZSOCK_POLLIN;
-		}
-		fds_len = node_cache_pos + 1;
+/* Remove the suspended nodes whose grace period ended */
+static void node_grace_handler(struct k_work *work)
+{
+	struct gb_interface *expired[MAX_GREYBUS_NODES];
+	struct node_control_data *ctrl_data;
+	int64_t now = k_uptime_get(), next = INT64_MAX;
+	k_spinlock_key_t key;
+	size_t i, count = 0;
+	int read_key;
 
-		LOG_DBG("Polling for %zu sockets", fds_len - 1);
-		ret = zsock_poll(fds, fds_len, -1);
-		if (ret < 0) {
-			LOG_ERR("Failed to poll");
+	read_key = node_read_lock();
+
+	key = seqlock_write_lock(&node_cache_lock);
+	for (i = 0; i < node_cache_pos; ++i) {
+		ctrl_data = node_cache[i].inf->ctrl_data;
+		if (ctrl_data->session != NODE_SESSION_SUSPENDED) {
 			continue;
 		}
 
-		if (fds[0].revents & ZSOCK_POLLIN) {
-			/* Drain the pipe */
-			LOG_DBG("Wakeup by pipe");
-			zsock_recv(fds[0].fd, &temp, sizeof(temp), 0);
-		}
-
-		for (i = 1; i < fds_len; ++i) {
-			if (fds[i].revents & ZSOCK_POLLNVAL) {
-				LOG_WRN("Socket invalid");
-				svc_send_module_removed_by_sock(fds[i].fd);
-			} else if (fds[i].revents & ZSOCK_POLLHUP) {
-				LOG_WRN("Socket pollhup");
-				svc_send_module_removed_by_sock(fds[i].fd);
-			} else if (fds[i].revents & ZSOCK_POLLERR) {
-				LOG_WRN("Socket error");
-				svc_send_module_removed_by_sock(fds[i].fd);
-			} else if (fds[i].revents & ZSOCK_POLLIN) {
-				ret = node_cache_find_by_sock(fds[i].fd);
-				if (ret < 0) {
-					LOG_ERR("Failed to find node");
-					continue;
-				}
+		if (ctrl_data->grace_until <= now) {
+			ctrl_data->session = NODE_SESSION_EXPIRED;
+			expired[count++] = node_cache[i].inf;
+		} else {
+			next = MIN(next, ctrl_data->grace_until);
+		}
+	}
+	seqlock_write_unlock(&node_cache_lock, key);
 
-				msg = gb_message_receive(fds[i].fd, &flag);
-				if (flag) {
-					LOG_ERR("Socket closed by peer");
-					svc_send_module_removed(node_cache[ret].inf);
-					continue;
-				}
+	for (i = 0; i < count; ++i) {
+		LOG_ERR("Node %u did not come back", expired[i]->id);
+		svc_send_module_removed(expired[i]);
+	}
 
-				if (!msg.msg) {
-					LOG_ERR("Failed to get full message");
-					svc_send_module_removed(node_cache[ret].inf);
-					continue;
-				}
+	node_read_unlock(read_key);
 
-				ret = connection_send(node_cache[ret].id, msg.cport_id, msg.msg);
-				if (ret < 0) {
-					LOG_ERR("Failed to send message to AP");
-					continue;
-				}
-			}
-		}
+	if (next != INT64_MAX) {
+		k_work_schedule_for_queue(&node_tx_workqueue, k_work_delayable_from_work(work),
+					  K_MSEC(next - now));
 	}
 }
 
-static int gb_message_send(int sock, const struct gb_message *msg, uint16_t cport)
+static struct gb_interface *node_create_interface(const struct in6_addr *addr,
+						  enum node_transport transport, uint8_t fail_count)
 {
 	int ret;
-	uint16_t cport_le = sys_cpu_to_le16(cport);
+	struct node_control_data *ctrl_data;
+	struct gb_interface *inf;
+	size_t i;
 
-	ret = write_data(sock, &cport_le, sizeof(uint16_t));
-	if (ret != sizeof(uint16_t)) {
-		LOG_ERR("Failed to send CPort ID to node");
+	ret = k_mem_slab_alloc(&node_control_data_slab, (void **)&ctrl_data, K_NO_WAIT);
+	if (ret) {
+		LOG_ERR("Failed to allocate Greybus connection");
 		goto early_exit;
 	}
 
-	ret = write_data(sock, &msg->header, sizeof(struct gb_operation_msg_hdr));
-	if (ret != sizeof(struct gb_operation_msg_hdr)) {
-		LOG_ERR("Failed to send Greybus Message Header to node");
-		goto early_exit;
+	ctrl_data->sock = -1;
+	ctrl_data->transport = transport;
+	ctrl_data->session = NODE_SESSION_ACTIVE;
+	ctrl_data->grace_until = 0;
+	atomic_set(&ctrl_data->last_active, k_uptime_get_32());
+	ctrl_data->rx.msg = NULL;
+	node_rx_state_init(&ctrl_data->rx, transport != NODE_TRANSPORT_TCP_CPORT, 0);
+	for (i = 0; i < NODE_MAX_CPORT_SOCKETS; ++i) {
+		ctrl_data->cports[i].sock = -1;
+		ctrl_data->cports[i].rx.msg = NULL;
+		ctrl_data->cports[i].resume = false;
 	}
 
-	ret = write_data(sock, msg->payload, gb_message_payload_len(msg));
-	if (ret != gb_message_payload_len(msg)) {
-		LOG_ERR("Failed to send Greybus Message Payload to node");
-		goto early_exit;
+	inf = gb_interface_alloc(node_inf_write, node_intf_create_connection,
+				 node_intf_destroy_connection, ctrl_data);
+	if (!inf) {
+		LOG_ERR("Failed to allocate Greybus interface");
+		goto free_ctrl_data;
 	}
+	node_tx_state_init(&ctrl_data->tx, inf);
+	node_heartbeat_init(&ctrl_data->heartbeat);
+	k_work_init_delayable(&ctrl_data->connect.work, node_connect_handler);
+	ctrl_data->connect.sock = -1;
 
-	return 0;
+	LOG_DBG("Create new interface with ID %u", inf->id);
+	ret = node_cache_add(-1, inf->id, addr, inf, fail_count);
+	if (ret < 0) {
+		LOG_ERR("Failed to add node to cache");
+		goto free_ctrl_data;
+	}
+
+	return inf;
 
+free_ctrl_data:
+	k_mem_slab_free(&node_control_data_slab, (void **)&ctrl_data);
 early_exit:
-	svc_send_module_removed_by_sock(sock);
-	return ret;
+	return NULL;
 }
 
-static int connect_to_node(const struct sockaddr *addr)
+void node_destroy_interface(struct gb_interface *inf)
 {
-	int ret, sock;
-	size_t addr_size;
+	struct node_control_data *ctrl_data;
+	k_spinlock_key_t key;
+	size_t i;
 
-	if (addr->sa_family == AF_INET6) {
-		sock = zsock_socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-		addr_size = sizeof(struct sockaddr_in6);
-	} else {
-		sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-		addr_size = sizeof(struct sockaddr_in);
+	if (inf == NULL) {
+		return;
 	}
 
-	if (sock < 0) {
-		LOG_ERR("Failed to create socket %d", errno);
-		return sock;
+	/* Unpublish first, so that the socket is not replaced and the node not destroyed twice */
+	if (node_cache_remove(inf) < 0) {
+		return;
 	}
 
-	ret = zsock_connect(sock, addr, addr_size);
-	if (ret) {
-		LOG_ERR("Failed to connect to node %d", errno);
-		goto fail;
+	ctrl_data = inf->ctrl_data;
+
+	/* Nothing can reach the node through its connections anymore */
+	connection_forget_interface(inf);
+	gb_operation_cancel_all(inf->id);
+
+	key = k_spin_lock(&node_tx_lock);
+	ctrl_data->tx.dead = true;
+	k_spin_unlock(&node_tx_lock, key);
+	node_tx_state_flush(&ctrl_data->tx);
+	node_connect_cancel(ctrl_data);
+
+	if (ctrl_data->sock >= 0) {
+		zsock_close(ctrl_data->sock);
 	}
 
-	return sock;
+	for (i = 0; i < NODE_MAX_CPORT_SOCKETS; ++i) {
+		if (ctrl_data->cports[i].sock >= 0) {
+			zsock_close(ctrl_data->cports[i].sock);
+		}
+	}
 
-fail:
-	zsock_close(sock);
-	return ret;
+	/* Readers may still hold the interface, receive states are reset once it is reclaimed */
+	key = k_spin_lock(&node_reclaim_lock);
+	sys_slist_append(&node_reclaim_pending, &ctrl_data->reclaim);
+	k_spin_unlock(&node_reclaim_lock, key);
+
+	k_work_schedule_for_queue(&node_tx_workqueue, &node_reclaim_work, K_NO_WAIT);
 }
 
-static int node_intf_create_connection(struct gb_interface *ctrl, uint16_t cport_id)
+/* Free the removed nodes once every read section that might have seen them has ended */
+static void node_reclaim_handler(struct k_work *work)
 {
-	struct sockaddr_in6 node_addr;
-	struct node_control_data *ctrl_data = ctrl->ctrl_data;
-	int ret, sock;
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct node_control_data *ctrl_data;
+	struct gb_interface *intf;
+	k_spinlock_key_t key;
+	sys_snode_t *snode;
+	bool pending;
+	size_t i;
 
-	/* Do not create socket for cports other than 0 */
-	if (cport_id != 0) {
-		return 0;
+	/* Nodes removed later wait for the next round, their readers may not be counted yet */
+	if (sys_slist_is_empty(&node_reclaim_draining)) {
+		key = k_spin_lock(&node_reclaim_lock);
+		sys_slist_merge_slist(&node_reclaim_draining, &node_reclaim_pending);
+		k_spin_unlock(&node_reclaim_lock, key);
+		node_reclaim_flips = 0;
 	}
 
-	/* It is possible for cport 0 to be disconnected. Since we are not closing the tcp socket,
-	 * do not recreate an existing socket */
-	if (ctrl_data->sock >= 0) {
-		return ctrl_data->sock;
+	if (sys_slist_is_empty(&node_reclaim_draining)) {
+		return;
 	}
 
-	ret = node_cache_find_by_id(ctrl->id);
-	if (ret < 0) {
-		LOG_ERR("Failed to find node %u in cache. This should not happen", ctrl->id);
-		return -EINVAL;
+	for (; node_reclaim_flips < 2; node_reclaim_flips++) {
+		if (node_reclaim_flips && !epoch_drained(&node_epoch, node_reclaim_epoch)) {
+			goto wait;
+		}
+		node_reclaim_epoch = epoch_flip(&node_epoch);
 	}
 
-	memcpy(&node_addr.sin6_addr, &node_cache[ret].addr, sizeof(struct in6_addr));
-	node_addr.sin6_family = AF_INET6;
-	node_addr.sin6_scope_id = 0;
-	node_addr.sin6_port = htons(GB_TRANSPORT_TCPIP_BASE_PORT);
+	if (!epoch_drained(&node_epoch, node_reclaim_epoch)) {
+		goto wait;
+	}
 
-	sock = connect_to_node((struct sockaddr *)&node_addr);
-	if (sock < 0) {
-		LOG_ERR("Failed to connect to node");
-		return sock;
+	while ((snode = sys_slist_get(&node_reclaim_draining))) {
+		ctrl_data = CONTAINER_OF(snode, struct node_control_data, reclaim);
+		intf = ctrl_data->tx.intf;
+
+		/* Messages queued by writers that raced with the removal */
+		node_tx_state_flush(&ctrl_data->tx);
+		node_connect_cancel(ctrl_data);
+		node_rx_state_reset(&ctrl_data->rx);
+		for (i = 0; i < NODE_MAX_CPORT_SOCKETS; ++i) {
+			node_rx_state_reset(&ctrl_data->cports[i].rx);
+		}
+
+		LOG_DBG("Freed node %u", intf->id);
+		k_mem_slab_free(&node_control_data_slab, (void **)&ctrl_data);
+		gb_interface_dealloc(intf);
 	}
-	node_cache[ret].sock = sock;
-	ctrl_data->sock = sock;
 
-	pipe_send();
+	key = k_spin_lock(&node_reclaim_lock);
+	pending = !sys_slist_is_empty(&node_reclaim_pending);
+	k_spin_unlock(&node_reclaim_lock, key);
 
-	return sock;
+	if (pending) {
+		k_work_schedule_for_queue(&node_tx_workqueue, dwork, K_NO_WAIT);
+	}
+	return;
+
+wait:
+	k_work_schedule_for_queue(&node_tx_workqueue, dwork, K_MSEC(NODE_RECLAIM_POLL_MS));
 }
 
-static void node_intf_destroy_connection(struct gb_interface *ctrl, uint16_t cport_id)
+int node_read_lock(void)
 {
-	/* Do Nothing */
+	return epoch_read_lock(&node_epoch);
 }
 
-static int node_inf_write(struct gb_interface *ctrl, struct gb_message *msg, uint16_t cport_id)
+void node_read_unlock(int key)
 {
-	int ret;
-	struct node_control_data *ctrl_data = ctrl->ctrl_data;
+	epoch_read_unlock(&node_epoch, key);
+}
 
-	ret = gb_message_send(ctrl_data->sock, msg, cport_id);
-	if (ret < 0) {
-		LOG_ERR("Socket seems closed");
-		svc_send_module_removed(ctrl);
+bool node_rx_is_current(void)
+{
+	for (size_t i = 0; i < NODE_RX_THREADS; ++i) {
+		if (k_current_get() == &node_rx_shards[i].thread) {
+			return true;
+		}
 	}
-	gb_message_dealloc(msg);
 
-	return ret;
+	return false;
 }
 
-static struct gb_interface *node_create_interface(struct in6_addr *addr)
+int node_tx_stats_get(uint8_t intf_id, struct node_tx_stats *stats)
 {
-	int ret;
 	struct node_control_data *ctrl_data;
-	struct gb_interface *inf;
+	struct node_tx_item *item;
+	struct node_item node;
+	k_spinlock_key_t key;
+	uint32_t now = k_uptime_get_32();
+	int read_key;
+
+	read_key = node_read_lock();
+	if (!node_cache_get_by_id(intf_id, &node)) {
+		node_read_unlock(read_key);
+		return -ENOENT;
+	}
+	ctrl_data = node.inf->ctrl_data;
 
-	ret = k_mem_slab_alloc(&node_control_data_slab, (void **)&ctrl_data, K_NO_WAIT);
-	if (ret) {
-		LOG_ERR("Failed to allocate Greybus connection");
-		goto early_exit;
+	key = k_spin_lock(&node_tx_lock);
+	*stats = ctrl_data->tx.stats;
+	stats->depth = ctrl_data->tx.depth;
+	stats->oldest_age_ms = 0;
+
+	/* Queues are FIFO, so the heads are the oldest messages */
+	item = SYS_SLIST_PEEK_HEAD_CONTAINER(&ctrl_data->tx.high_prio, item, snode);
+	if (item) {
+		stats->oldest_age_ms = now - item->enqueued;
 	}
 
-	ctrl_data->sock = -1;
+	item = SYS_SLIST_PEEK_HEAD_CONTAINER(&ctrl_data->tx.queue, item, snode);
+	if (item) {
+		stats->oldest_age_ms = MAX(stats->oldest_age_ms, now - item->enqueued);
+	}
+	k_spin_unlock(&node_tx_lock, key);
+	node_read_unlock(read_key);
 
-	inf = gb_interface_alloc(node_inf_write, node_intf_create_connection,
-				 node_intf_destroy_connection, ctrl_data);
-	if (!inf) {
-		LOG_ERR("Failed to allocate Greybus interface");
-		goto free_ctrl_data;
+	return 0;
+}
+
+int node_heartbeat_stats_get(uint8_t intf_id, struct node_heartbeat_stats *stats)
+{
+	struct node_control_data *ctrl_data;
+	struct node_item node;
+	k_spinlock_key_t key;
+	int read_key;
+
+	read_key = node_read_lock();
+	if (!node_cache_get_by_id(intf_id, &node)) {
+		node_read_unlock(read_key);
+		return -ENOENT;
 	}
+	ctrl_data = node.inf->ctrl_data;
 
-	LOG_DBG("Create new interface with ID %u", inf->id);
-	ret = node_cache_add(-1, inf->id, addr, inf);
-	if (ret < 0) {
-		LOG_ERR("Failed to add node to cache");
-		goto free_ctrl_data;
+	key = k_spin_lock(&node_heartbeat_lock);
+	*stats = ctrl_data->heartbeat.stats;
+	k_spin_unlock(&node_heartbeat_lock, key);
+	node_read_unlock(read_key);
+
+	return 0;
+}
+
+int node_rx_stats_get(uint8_t shard, struct node_rx_stats *stats)
+{
+	if (shard >= NODE_RX_THREADS) {
+		return -EINVAL;
 	}
 
-	return inf;
+	/* Counters are only written by the RX thread, a torn read is harmless */
+	*stats = node_rx_shards[shard].stats;
+	stats->sockets = node_rx_shards[shard].fds_len ? node_rx_shards[shard].fds_len - 1 : 0;
+	stats->shards = NODE_RX_THREADS;
 
-free_ctrl_data:
-	k_mem_slab_free(&node_control_data_slab, (void **)&ctrl_data);
-early_exit:
-	return NULL;
+	return 0;
 }
 
-void node_destroy_interface(struct gb_interface *inf)
+void node_init(void)
 {
-	struct node_control_data *ctrl_data;
+	const struct k_work_queue_config cfg = {
+		.name = "node_tx_workqueue",
+		.no_yield = false,
+	};
+	struct node_rx_shard *shard;
+	size_t i;
 
-	if (inf == NULL) {
-		return;
+	for (i = 0; i < NODE_RX_THREADS; ++i) {
+		shard = &node_rx_shards[i];
+		shard->pipe_writer = -1;
+		k_msgq_init(&shard->event_queue, shard->event_queue_buf,
+			    sizeof(struct node_rx_event), NODE_RX_EVENT_QUEUE_DEPTH);
+		k_thread_create(&shard->thread, node_rx_thread_stacks[i],
+				K_THREAD_STACK_SIZEOF(node_rx_thread_stacks[i]),
+				node_rx_thread_entry, shard, NULL, NULL, NODE_RX_THREAD_PRIORITY, 0,
+				K_NO_WAIT);
+		k_thread_name_set(&shard->thread, "node_rx");
 	}
 
-	ctrl_data = inf->ctrl_data;
+	k_work_queue_init(&node_tx_workqueue);
+	k_work_queue_start(&node_tx_workqueue, node_tx_workqueue_stack,
+			   NODE_TX_WORKQUEUE_STACK_SIZE, NODE_TX_WORKQUEUE_PRIORITY, &cfg);
 
-	if (ctrl_data->sock >= 0) {
-		zsock_close(ctrl_data->sock);
+	if (NODE_HEARTBEAT_INTERVAL_MS) {
+		k_work_schedule_for_queue(&node_tx_workqueue, &node_heartbeat_work,
+					  K_MSEC(NODE_HEARTBEAT_INTERVAL_MS));
 	}
 
-	node_cache_remove_by_id(inf->id);
-	k_mem_slab_free(&node_control_data_slab, (void **)&ctrl_data);
-	gb_interface_dealloc(inf);
+	if (IS_ENABLED(CONFIG_BEAGLEPLAY_GREYBUS_NODE_LAZY_CONNECT) && NODE_IDLE_CLOSE_MS) {
+		k_work_schedule_for_queue(&node_tx_workqueue, &node_idle_work,
+					  K_MSEC(NODE_IDLE_CLOSE_MS / 2));
+	}
 }
 
 struct gb_interface *node_find_by_id(uint8_t id)
 {
-	int ret = node_cache_find_by_id(id);
+	struct node_item node;
 
-	return (ret >= 0) ? node_cache[ret].inf : NULL;
+	return node_cache_get_by_id(id, &node) ? node.inf : NULL;
 }
 
-void node_filter(struct in6_addr *active_addr, size_t active_len)
+void node_filter(const struct in6_addr *active_addr, const enum node_transport *transports,
+		 size_t active_len)
 {
+	enum node_transport transport;
+	struct node_item node;
+	uint8_t fail_count;
 	size_t i;
 	struct gb_interface *inf;
-	int ret;
+	int key;
 
 	for (i = 0; i < active_len; ++i) {
-		ret = node_cache_find_by_addr(&active_addr[i]);
-
-		/* Handle New Node */
-		if (ret < 0) {
-			LOG_DBG("New node discovered");
-			inf = node_create_interface(&active_addr[i]);
-			if (!inf) {
-				LOG_ERR("Failed to create interface");
-				continue;
+		/* A node that lost its connection comes back with its old interface */
+		key = node_read_lock();
+		if (node_cache_get_by_addr(&active_addr[i], &node)) {
+			if (NODE_RESUME_GRACE_MS) {
+				node_resume(node.inf);
 			}
-			svc_send_module_inserted(inf->id);
+			node_read_unlock(key);
+			continue;
+		}
+		node_read_unlock(key);
+
+		/* Handle New Node. Nodes that failed to connect wait for their backoff. */
+		if (node_backoff_active(&active_addr[i], &fail_count)) {
+			continue;
+		}
+
+		LOG_DBG("New node discovered");
+		transport = transports ? transports[i] : NODE_TRANSPORT_TCP;
+		inf = node_create_interface(&active_addr[i], transport, fail_count);
+		if (!inf) {
+			LOG_ERR("Failed to create interface");
+			continue;
 		}
+		svc_send_module_inserted(inf->id);
 	}
 }
 
 void node_destroy_all(void)
 {
-	size_t i;
-
-	for (i = 0; i < node_cache_pos; ++i) {
-		node_destroy_interface(node_cache[i].inf);
+	struct gb_interface *inf;
+	int key;
+
+	do {
+		key = node_read_lock();
+		inf = node_cache_first();
+		node_destroy_interface(inf);
+		node_read_unlock(key);
+	} while (inf);
+
+	/* Freed by node_reclaim_handler() */
+	while (k_mem_slab_num_used_get(&node_control_data_slab)) {
+		k_sleep(K_MSEC(NODE_RECLAIM_POLL_MS));
 	}
-
-	node_cache_pos = 0;
-
-	assert(!k_mem_slab_num_used_get(&node_control_data_slab));
 }
@@ -10,6 +10,7 @@
 #include "ap.h"
 #include "greybus_protocols.h"
 #include "greybus_messages.h"
+#include "greybus_operations.h"
 #include "node.h"
 #include <zephyr/sys/dlist.h>
 #include <errno.h>
@@ -20,12 +21,45 @@
 #define ENDO_ID           0x4755
 #define MAX_GREYBUS_NODES CONFIG_BEAGLEPLAY_GREYBUS_MAX_NODES
 
+#define SVC_CONN_QUEUE_DEPTH       8
+#define SVC_CONN_THREAD_STACK_SIZE 2048
+#define SVC_CONN_THREAD_PRIORITY   7
+
+/* Timeout the AP applies to SVC operations. A later response is ignored by it. */
+#define SVC_AP_OPERATION_TIMEOUT_MS 1000
+
 LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
 ATOMIC_DEFINE(svc_is_read_flag, 1);
 
 static int svc_inf_write(struct gb_interface *, struct gb_message *, uint16_t);
 
+/*
+ * Connection create or destroy request waiting to be processed.
+ *
+ * @param req: connection request. A destroy request only uses the leading fields.
+ * @param received: uptime at which the request was received, in ms
+ * @param operation_id: operation id of the request, for the deferred response
+ * @param type: GB_SVC_TYPE_CONN_CREATE or GB_SVC_TYPE_CONN_DESTROY
+ */
+struct svc_conn_item {
+	struct gb_svc_conn_create_request req;
+	int64_t received;
+	uint16_t operation_id;
+	uint8_t type;
+};
+
+static void svc_conn_thread_entry(void *p1, void *p2, void *p3);
+
+/*
+ * Connecting to a node can block, so it is kept off the HDLC RX workqueue. Destroy requests go
+ * through the same queue so that they cannot overtake the create they undo.
+ */
+K_MSGQ_DEFINE(svc_conn_queue, sizeof(struct svc_conn_item), SVC_CONN_QUEUE_DEPTH, 4);
+
+K_THREAD_DEFINE(svc_conn_thread, SVC_CONN_THREAD_STACK_SIZE, svc_conn_thread_entry, NULL, NULL,
+		NULL, SVC_CONN_THREAD_PRIORITY, 0, 0);
+
 static int svc_inf_create_connection(struct gb_interface *ctrl, uint16_t cport_id)
 {
 	ARG_UNUSED(ctrl);
@@ -52,23 +86,42 @@ static struct gb_interface intf = {.id = SVC_INF_ID,
 				   .destroy_connection = svc_inf_destroy_connection,
 				   .ctrl_data = NULL};
 
-static int control_send_request(void *payload, size_t payload_len, uint8_t request_type)
+static int control_send_request(void *payload, size_t payload_len, uint8_t request_type,
+				gb_operation_callback_t callback, void *user_data)
 {
 	int ret;
 	struct gb_message *msg;
 
-	msg = gb_message_request_alloc(payload, payload_len, request_type, false);
+	msg = gb_message_request_alloc(payload, payload_len, request_type);
 	if (msg == NULL) {
 		return -ENOMEM;
 	}
 
-	ret = connection_send(SVC_INF_ID, 0, msg);
+	ret = gb_operation_send_request(SVC_INF_ID, 0, msg, GB_OPERATION_TIMEOUT_MS,
+					GB_OPERATION_RETRIES, callback, user_data);
 	if (ret < 0) {
 		LOG_ERR("Failed to send SVC message");
-		return ret;
 	}
 
-	return msg->header.operation_id;
+	return ret;
+}
+
+static void svc_hello_response_handler(const struct gb_operation *op,
+				       const struct gb_message *msg, int status)
+{
+	ARG_UNUSED(op);
+
+	if (status < 0 || !gb_message_is_success(msg)) {
+		LOG_ERR("Hello Request failed");
+		return;
+	}
+
+	LOG_DBG("Hello Response Success");
+
+#ifdef CONFIG_BEAGLEPLAY_GREYBUS_LOCAL_NODE
+	/* Add local Module */
+	svc_send_module_inserted(LOCAL_NODE_ID);
+#endif
 }
 
 static int svc_send_hello(void)
@@ -76,17 +129,17 @@ static int svc_send_hello(void)
 	struct gb_svc_hello_request req = {.endo_id = ENDO_ID, .interface_id = AP_INF_ID};
 
 	return control_send_request(&req, sizeof(struct gb_svc_hello_request),
-				    GB_SVC_TYPE_SVC_HELLO);
+				    GB_SVC_TYPE_SVC_HELLO, svc_hello_response_handler, NULL);
 }
 
-static void svc_response_helper(struct gb_message *msg, const void *payload, size_t payload_len,
-				uint8_t status)
+static void svc_send_response(uint8_t request_type, uint16_t operation_id, const void *payload,
+			      size_t payload_len, uint8_t status)
 {
 	int ret;
-	struct gb_message *resp = gb_message_response_alloc(payload, payload_len, msg->header.type,
-							    msg->header.operation_id, status);
+	struct gb_message *resp =
+		gb_message_response_alloc(payload, payload_len, request_type, operation_id, status);
 	if (resp == NULL) {
-		LOG_ERR("Failed to allocate response for %X", msg->header.type);
+		LOG_ERR("Failed to allocate response for %X", request_type);
 		return;
 	}
 	ret = connection_send(SVC_INF_ID, 0, resp);
@@ -95,22 +148,33 @@ static void svc_response_helper(struct gb_message *msg, const void *payload, siz
 	}
 }
 
-static void svc_version_response_handler(struct gb_message *msg)
+static void svc_response_helper(struct gb_message *msg, const void *payload, size_t payload_len,
+				uint8_t status)
 {
-	struct gb_svc_version_request *response = (struct gb_svc_version_request *)msg->payload;
-
-	LOG_DBG("SVC Protocol Version %u.%u", response->major, response->minor);
-	svc_send_hello();
+	svc_send_response(msg->header.type, sys_le16_to_cpu(msg->header.operation_id), payload,
+			  payload_len, status);
 }
 
-static void svc_hello_response_handler(struct gb_message *msg)
+static void svc_version_response_handler(const struct gb_operation *op,
+					 const struct gb_message *msg, int status)
 {
-	ARG_UNUSED(msg);
+	ARG_UNUSED(op);
 
-	LOG_DBG("Hello Response Success");
+	struct gb_svc_version_request *response;
 
-	/* Add local Module */
-	// svc_send_module_inserted(LOCAL_NODE_ID);
+	if (status < 0 || !gb_message_is_success(msg)) {
+		LOG_ERR("SVC Version Request failed");
+		return;
+	}
+
+	if (gb_message_payload_len(msg) < sizeof(*response)) {
+		LOG_ERR("Invalid SVC Version Response");
+		return;
+	}
+
+	response = (struct gb_svc_version_request *)msg->payload;
+	LOG_DBG("SVC Protocol Version %u.%u", response->major, response->minor);
+	svc_send_hello();
 }
 
 static void svc_empty_request_handler(struct gb_message *msg)
@@ -191,37 +255,35 @@ static void svc_dme_peer_set_handler(struct gb_message *msg)
 			    GB_SVC_OP_SUCCESS);
 }
 
-static void svc_connection_create_handler(struct gb_message *msg)
+static uint8_t svc_conn_create(const struct svc_conn_item *item)
 {
+	const struct gb_svc_conn_create_request *req = &item->req;
 	int ret;
-	struct gb_svc_conn_create_request *req = (struct gb_svc_conn_create_request *)msg->payload;
-
-	if (req->intf1_id == req->intf2_id && req->cport1_id == req->cport2_id) {
-		LOG_ERR("Cannot create loop connection");
-		goto fail;
-	}
 
 	ret = connection_create(req->intf1_id, req->cport1_id, req->intf2_id, req->cport2_id);
 	if (ret < 0) {
 		LOG_ERR("Failed to create connection");
-		goto fail;
+		return GB_SVC_OP_UNKNOWN_ERROR;
 	}
 
-	LOG_DBG("Created connection between Intf %u, Cport %u and Intf %u, Cport %u", req->intf1_id,
-		req->cport1_id, req->intf2_id, req->cport2_id);
-
-	svc_response_helper(msg, NULL, 0, GB_SVC_OP_SUCCESS);
-	return;
+	/* The AP has given up on the request and will not use, nor destroy, the connection */
+	if (k_uptime_get() - item->received >= SVC_AP_OPERATION_TIMEOUT_MS) {
+		LOG_ERR("Connection between Intf %u, Cport %u and Intf %u, Cport %u created too "
+			"late",
+			req->intf1_id, req->cport1_id, req->intf2_id, req->cport2_id);
+		connection_destroy(req->intf1_id, req->cport1_id, req->intf2_id, req->cport2_id);
+		return GB_SVC_OP_UNKNOWN_ERROR;
+	}
 
-fail:
-	svc_response_helper(msg, NULL, 0, GB_SVC_OP_UNKNOWN_ERROR);
+	LOG_DBG("Created connection between Intf %u, Cport %u and Intf %u, Cport %u",
+		req->intf1_id, req->cport1_id, req->intf2_id, req->cport2_id);
+	return GB_SVC_OP_SUCCESS;
 }
 
-static void svc_connection_destroy_handler(struct gb_message *msg)
+static uint8_t svc_conn_destroy(const struct svc_conn_item *item)
 {
+	const struct gb_svc_conn_create_request *req = &item->req;
 	int ret;
-	struct gb_svc_conn_destroy_request *req =
-		(struct gb_svc_conn_destroy_request *)msg->payload;
 
 	LOG_DBG("Destroy connection between Intf %u, Cport %u and Intf %u, Cport %u", req->intf1_id,
 		req->cport1_id, req->intf2_id, req->cport2_id);
@@ -230,16 +292,88 @@ static void svc_connection_destroy_handler(struct gb_message *msg)
 		LOG_ERR("Failed to destroy connection %d between Cport 1: %u of Interface 1: %u "
 			"and Cport 2: %u of Interface 2: %u",
 			ret, req->cport1_id, req->intf1_id, req->cport2_id, req->intf2_id);
+		return GB_SVC_OP_UNKNOWN_ERROR;
+	}
+
+	return GB_SVC_OP_SUCCESS;
+}
+
+static void svc_conn_thread_entry(void *p1, void *p2, void *p3)
+{
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	struct svc_conn_item item;
+	uint8_t status;
+
+	while (1) {
+		k_msgq_get(&svc_conn_queue, &item, K_FOREVER);
+
+		if (item.type == GB_SVC_TYPE_CONN_CREATE) {
+			status = svc_conn_create(&item);
+		} else {
+			status = svc_conn_destroy(&item);
+		}
+
+		svc_send_response(item.type, item.operation_id, NULL, 0, status);
+	}
+}
+
+/*
+ * Queue a connection request for svc_conn_thread, which sends the response.
+ *
+ * @param greybus message of the request
+ * @param size of the request payload
+ *
+ * @return 0 if queued. Negative in case of error
+ */
+static int svc_conn_queue_put(const struct gb_message *msg, size_t req_len)
+{
+	struct svc_conn_item item = {
+		.received = k_uptime_get(),
+		.operation_id = sys_le16_to_cpu(msg->header.operation_id),
+		.type = gb_message_type(msg),
+	};
+
+	memcpy(&item.req, msg->payload, req_len);
+
+	if (k_msgq_put(&svc_conn_queue, &item, K_NO_WAIT)) {
+		LOG_ERR("Too many pending connection requests");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void svc_connection_create_handler(struct gb_message *msg)
+{
+	struct gb_svc_conn_create_request *req =
+		(struct gb_svc_conn_create_request *)msg->payload;
+
+	if (req->intf1_id == req->intf2_id && req->cport1_id == req->cport2_id) {
+		LOG_ERR("Cannot create loop connection");
+		goto fail;
+	}
+
+	/* The response is sent once the connection is established */
+	if (svc_conn_queue_put(msg, sizeof(*req)) < 0) {
 		goto fail;
 	}
 
-	svc_response_helper(msg, NULL, 0, GB_SVC_OP_SUCCESS);
 	return;
 
 fail:
 	svc_response_helper(msg, NULL, 0, GB_SVC_OP_UNKNOWN_ERROR);
 }
 
+static void svc_connection_destroy_handler(struct gb_message *msg)
+{
+	if (svc_conn_queue_put(msg, sizeof(struct gb_svc_conn_destroy_request)) < 0) {
+		svc_response_helper(msg, NULL, 0, GB_SVC_OP_UNKNOWN_ERROR);
+	}
+}
+
 static void svc_interface_resume_handler(struct gb_message *msg)
 {
 	struct gb_svc_intf_resume_response resp = {.status = GB_SVC_OP_SUCCESS};
@@ -248,17 +382,44 @@ static void svc_interface_resume_handler(struct gb_message *msg)
 			    GB_SVC_OP_SUCCESS);
 }
 
-static void svc_module_inserted_response_handler(struct gb_message *msg)
+static void svc_module_inserted_response_handler(const struct gb_operation *op,
+						 const struct gb_message *msg, int status)
 {
-	if (!gb_message_is_success(msg)) {
-		/* TODO: Add functionality to remove the interface in case of error */
-		LOG_ERR("Module Inserted Event failed");
+	struct gb_interface *intf;
+	uint8_t intf_id = POINTER_TO_UINT(op->user_data);
+	int key;
+
+	if (status == -ECANCELED || (status == 0 && gb_message_is_success(msg))) {
+		return;
 	}
+
+	LOG_ERR("Module Inserted Event for Interface %u failed %d", intf_id, status);
+
+	/* Drop the half-enumerated interface. Discovery will find the node again and retry the
+	 * enumeration from scratch. */
+	key = node_read_lock();
+	intf = node_find_by_id(intf_id);
+	if (!intf) {
+		goto unlock;
+	}
+
+	if (status == -ETIMEDOUT) {
+		/* The AP might have seen the request even though no response arrived */
+		svc_send_module_removed(intf);
+	} else {
+		node_destroy_interface(intf);
+	}
+
+unlock:
+	node_read_unlock(key);
 }
 
-static void svc_module_removed_response_handler(struct gb_message *msg)
+static void svc_module_removed_response_handler(const struct gb_operation *op,
+						const struct gb_message *msg, int status)
 {
-	if (!gb_message_is_success(msg)) {
+	ARG_UNUSED(op);
+
+	if (status < 0 || !gb_message_is_success(msg)) {
 		LOG_DBG("Module Removal Failed");
 	}
 }
@@ -308,18 +469,6 @@ static void gb_handle_msg(struct gb_message *msg)
 	case GB_SVC_TYPE_INTF_RESUME:
 		svc_interface_resume_handler(msg);
 		break;
-	case GB_RESPONSE(GB_SVC_TYPE_PROTOCOL_VERSION):
-		svc_version_response_handler(msg);
-		break;
-	case GB_RESPONSE(GB_SVC_TYPE_SVC_HELLO):
-		svc_hello_response_handler(msg);
-		break;
-	case GB_RESPONSE(GB_SVC_TYPE_MODULE_INSERTED):
-		svc_module_inserted_response_handler(msg);
-		break;
-	case GB_RESPONSE(GB_SVC_TYPE_MODULE_REMOVED):
-		svc_module_removed_response_handler(msg);
-		break;
 	default:
 		LOG_WRN("Handling SVC operation Type %X not supported yet", msg->header.type);
 	}
@@ -332,7 +481,15 @@ static int svc_inf_write(struct gb_interface *ctrl, struct gb_message *msg, uint
 		return -1;
 	}
 
-	gb_handle_msg(msg);
+	if (gb_message_is_response(msg)) {
+		if (!gb_operation_handle_response(SVC_INF_ID, cport_id, msg)) {
+			LOG_WRN("Unexpected SVC response %u of type %X",
+				sys_le16_to_cpu(msg->header.operation_id), gb_message_type(msg));
+		}
+	} else {
+		gb_handle_msg(msg);
+	}
+
 	gb_message_dealloc(msg);
 	return 0;
 }
@@ -342,7 +499,9 @@ int svc_send_module_inserted(uint8_t primary_intf_id)
 	struct gb_svc_module_inserted_request req = {
 		.primary_intf_id = primary_intf_id, .intf_count = 1, .flags = 0};
 	return control_send_request(&req, sizeof(struct gb_svc_module_inserted_request),
-				    GB_SVC_TYPE_MODULE_INSERTED);
+				    GB_SVC_TYPE_MODULE_INSERTED,
+				    svc_module_inserted_response_handler,
+				    UINT_TO_POINTER(primary_intf_id));
 }
 
 int svc_send_module_removed(struct gb_interface *intf)
@@ -350,7 +509,8 @@ int svc_send_module_removed(struct gb_interface *intf)
 	int ret;
 	struct gb_svc_module_removed_request req = {.primary_intf_id = sys_cpu_to_le16(intf->id)};
 
-	ret = control_send_request(&req, sizeof(req), GB_SVC_TYPE_MODULE_REMOVED);
+	ret = control_send_request(&req, sizeof(req), GB_SVC_TYPE_MODULE_REMOVED,
+				   svc_module_removed_response_handler, NULL);
 	if (ret < 0) {
 		return ret;
 	}
@@ -365,7 +525,8 @@ int svc_send_version(void)
 	struct gb_svc_version_request req = {.major = GB_SVC_VERSION_MAJOR,
 					     .minor = GB_SVC_VERSION_MINOR};
 	return control_send_request(&req, sizeof(struct gb_svc_version_request),
-				    GB_SVC_TYPE_PROTOCOL_VERSION);
+				    GB_SVC_TYPE_PROTOCOL_VERSION, svc_version_response_handler,
+				    NULL);
 }
 
 void svc_init(void)
@@ -385,6 +546,8 @@ struct gb_interface *svc_interface(void)
 void svc_deinit(void)
 {
 	atomic_set_bit_to(svc_is_read_flag, 0, false);
+	k_msgq_purge(&svc_conn_queue);
+	gb_operation_cancel_all(SVC_INF_ID);
 }
 
 bool svc_is_ready(void)
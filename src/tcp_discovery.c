@@ -23,18 +23,30 @@ static struct tcp_discovery_data tcp_discovery_data = {.sock = -1};
 static void handler(void *p1, void *p2, void *p3)
 {
 	static const char addr[] = CONFIG_BEAGLEPLAY_GREYBUS_NODE1;
+	static const enum node_transport transport =
+		IS_ENABLED(CONFIG_BEAGLEPLAY_GREYBUS_NODE1_CPORT_SOCKETS) ? NODE_TRANSPORT_TCP_CPORT
+									 : NODE_TRANSPORT_TCP;
 	struct sockaddr_in6 addr6;
 
 	net_ipaddr_parse(addr, sizeof(addr), (struct sockaddr *)&addr6);
 
 	while (1) {
 		k_msleep(NODE_DISCOVERY_INTERVAL);
-		node_filter(&addr6.sin6_addr, 1);
+		node_filter(&addr6.sin6_addr, &transport, 1);
 	}
 }
 
 #else
 
+/* The service type advertised by a node selects its transport */
+static const struct {
+	const char *query;
+	enum node_transport transport;
+} services[] = {
+	{"_greybus._tcp.local", NODE_TRANSPORT_TCP},
+	{"_greybus._udp.local", NODE_TRANSPORT_UDP},
+};
+
 static void handler(void *p1, void *p2, void *p3)
 {
 	ARG_UNUSED(p1);
@@ -43,7 +55,9 @@ static void handler(void *p1, void *p2, void *p3)
 
 	int ret;
 	struct in6_addr node_array[MAX_GREYBUS_NODES];
-	char query[] = "_greybus._tcp.local\0";
+	enum node_transport transports[MAX_GREYBUS_NODES];
+	const char *query;
+	size_t i, j, found;
 
 	while (1) {
 		k_msleep(NODE_DISCOVERY_INTERVAL);
@@ -52,20 +66,27 @@ static void handler(void *p1, void *p2, void *p3)
 			continue;
 		}
 
-		ret = mdns_query_send(tcp_discovery_data.sock, query, strlen(query));
-		if (ret < 0) {
-			LOG_WRN("Failed to get greybus nodes");
-			continue;
-		}
-
-		ret = mdns_query_recv(tcp_discovery_data.sock, node_array, MAX_GREYBUS_NODES, query,
-				      strlen(query), 2000);
-		if (ret < 0) {
-			LOG_WRN("Failed to get greybus nodes");
-			continue;
+		found = 0;
+		for (i = 0; i < ARRAY_SIZE(services) && found < MAX_GREYBUS_NODES; ++i) {
+			query = services[i].query;
+
+			ret = mdns_query_send(tcp_discovery_data.sock, query, strlen(query));
+			if (ret < 0) {
+				LOG_WRN("Failed to get greybus nodes");
+				continue;
+			}
+
+			ret = mdns_query_recv(tcp_discovery_data.sock, &node_array[found],
+					      MAX_GREYBUS_NODES - found, query, strlen(query),
+					      2000);
+			for (j = found; j < found + ret; ++j) {
+				transports[j] = services[i].transport;
+			}
+			found += ret;
 		}
 
-		node_filter(node_array, ret);
+		/* A node advertising both services is reached over TCP */
+		node_filter(node_array, transports, found);
 	}
 }
 